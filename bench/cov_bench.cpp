@@ -0,0 +1,332 @@
+// cov_bench: micro benchmarks of cov.hpp, results as JSON on stdout or in the
+// file given as first argument. A Chrome trace of one profiled matmul run goes
+// to the second argument, cov_bench.trace.json by default. Validation is off,
+// run it on a release build.
+#define COV_IMPLEMENTATION
+#include "cov.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef COV_BENCH_SHADER_DIR
+#   define COV_BENCH_SHADER_DIR "shader"
+#endif // COV_BENCH_SHADER_DIR
+
+namespace {
+
+const std::string empty_shader{COV_BENCH_SHADER_DIR "/empty.comp.spv"};
+const std::string matmul_shader{COV_BENCH_SHADER_DIR "/matmul.comp.spv"};
+const std::string gemm_shader{COV_BENCH_SHADER_DIR "/gemm.comp.spv"};
+
+double now_us()
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// device time of the steps, in the order they were added
+std::vector<double> step_ns(cov::Instance& instance)
+{
+    std::vector<double> durations;
+    for (const auto& timing : instance.profile()) {
+        durations.push_back(timing.duration_ns);
+    }
+    return durations;
+}
+
+// matmul.comp buffers start with dims, col and row
+std::vector<char> square_mat(int n, float value)
+{
+    std::vector<char> bytes(3 * sizeof(int) + static_cast<size_t>(n) * n * sizeof(float));
+    const int header[3]{2, n, n};
+    std::memcpy(bytes.data(), header, sizeof(header));
+    auto data{reinterpret_cast<float*>(bytes.data() + sizeof(header))};
+    for (size_t i = 0; i < static_cast<size_t>(n) * n; ++i) {
+        data[i] = value;
+    }
+    return bytes;
+}
+
+void bench_transfer(std::ostream& os, bool unified_memory)
+{
+    const std::vector<size_t> sizes{4ull << 10, 64ull << 10, 1ull << 20, 16ull << 20, 64ull << 20};
+    const int iterations{5};
+
+    // unified memory has no copies to time, the graph elides them
+    os << "\"transfer\":[";
+    for (size_t s = 0; s < sizes.size() && !unified_memory; ++s) {
+        const size_t size{sizes.at(s)};
+        auto instance{cov::Vulkan::new_instance()};
+        instance.set_profiling(true);
+        auto mapping{instance.add_mem_mapping(size)};
+        instance.add_transfer_step()->to_device(mapping);
+        instance.add_transfer_step()->from_device(mapping);
+
+        // best of the iterations, copies are timed on the device
+        double h2d_ns{0.0}, d2h_ns{0.0}, wall_us{0.0};
+        for (int i = 0; i < iterations; ++i) {
+            const double begin{now_us()};
+            instance.execute();
+            const double elapsed{now_us() - begin};
+            const auto durations{step_ns(instance)};
+            if (durations.size() == 2) {
+                h2d_ns = i == 0 ? durations.at(0) : std::min(h2d_ns, durations.at(0));
+                d2h_ns = i == 0 ? durations.at(1) : std::min(d2h_ns, durations.at(1));
+            }
+            wall_us = i == 0 ? elapsed : std::min(wall_us, elapsed);
+        }
+
+        os << (s == 0 ? "" : ",") << "{\"bytes\":" << size
+            << ",\"h2d_gbps\":" << (h2d_ns > 0.0 ? size / h2d_ns : 0.0)
+            << ",\"d2h_gbps\":" << (d2h_ns > 0.0 ? size / d2h_ns : 0.0)
+            << ",\"execute_us\":" << wall_us << "}";
+    }
+    os << "]";
+}
+
+void bench_execute_latency(std::ostream& os)
+{
+    const int iterations{200};
+    auto instance{cov::Vulkan::new_instance()};
+    instance.add_compute_step()->load_shader(empty_shader)->build();
+    instance.execute();
+
+    const double begin{now_us()};
+    for (int i = 0; i < iterations; ++i) {
+        instance.execute();
+    }
+    os << "\"execute_latency_us\":" << (now_us() - begin) / iterations;
+}
+
+void bench_empty_dispatch(std::ostream& os)
+{
+    const int dispatches{256};
+    const int iterations{20};
+    auto instance{cov::Vulkan::new_instance()};
+    for (int d = 0; d < dispatches; ++d) {
+        instance.add_compute_step()->load_shader(empty_shader)->build();
+    }
+    instance.execute();
+
+    const double begin{now_us()};
+    for (int i = 0; i < iterations; ++i) {
+        instance.execute();
+    }
+    const double us_per_execute{(now_us() - begin) / iterations};
+    os << "\"empty_dispatch\":{\"dispatches_per_execute\":" << dispatches
+        << ",\"us_per_dispatch\":" << us_per_execute / dispatches
+        << ",\"dispatches_per_s\":" << dispatches * 1e6 / us_per_execute << "}";
+}
+
+// first compile() of a one step graph, with and without a warm pipeline cache
+double pipeline_build_ms(const std::string& cache_path)
+{
+    auto instance{cov::Vulkan::new_instance()};
+    if (!cache_path.empty()) {
+        instance.set_pipeline_cache_path(cache_path);
+    }
+    auto a{instance.add_mem_mapping(64)};
+    instance.add_compute_step()->load_shader(matmul_shader)->set_inputs({a, a})->set_outputs({a})->build();
+
+    const double begin{now_us()};
+    instance.compile();
+    return (now_us() - begin) / 1000.0;
+}
+
+void bench_pipeline_build(std::ostream& os)
+{
+    const std::string cache_path{"cov_bench.pipeline_cache"};
+    std::remove(cache_path.c_str());
+    const double cold_ms{pipeline_build_ms("")};
+    // the first run fills the cache file, the second one loads it
+    pipeline_build_ms(cache_path);
+    const double cached_ms{pipeline_build_ms(cache_path)};
+    std::remove(cache_path.c_str());
+
+    os << "\"pipeline_build_ms\":{\"cold\":" << cold_ms << ",\"cached\":" << cached_ms << "}";
+}
+
+// best device time of the GEMM step over a few runs
+double gemm_ns(cov::Instance& instance, const cov::ComputeStep* step, int iterations)
+{
+    double best_ns{0.0};
+    for (int i = 0; i < iterations; ++i) {
+        instance.execute();
+        for (const auto& timing : instance.profile()) {
+            if (timing.compute_step == step) {
+                best_ns = best_ns == 0.0 ? timing.duration_ns : std::min(best_ns, timing.duration_ns);
+            }
+        }
+    }
+    return best_ns;
+}
+
+void write_gemm(std::ostream& os, bool first, int n, const char* kernel, double ns, bool valid)
+{
+    os << (first ? "" : ",") << "{\"n\":" << n
+        << ",\"kernel\":\"" << kernel << "\""
+        << ",\"gflops\":" << (ns > 0.0 ? 2.0 * n * n * n / ns : 0.0)
+        << ",\"valid\":" << (valid ? "true" : "false") << "}";
+}
+
+// naive examples/shader/matmul.comp against the tiled examples/shader/gemm.comp
+void bench_gemm(std::ostream& os)
+{
+    const std::vector<int> sizes{64, 128, 256, 512, 1024};
+    const int iterations{3};
+
+    os << "\"gemm\":[";
+    for (size_t s = 0; s < sizes.size(); ++s) {
+        const int n{sizes.at(s)};
+        const float expected{2.0f * n};
+        // the naive kernel takes too long past 512
+        if (n <= 512) {
+            const auto A{square_mat(n, 1.0f)};
+            const auto B{square_mat(n, 2.0f)};
+            auto C{square_mat(n, 0.0f)};
+
+            auto instance{cov::Vulkan::new_instance()};
+            instance.set_profiling(true);
+            auto a{instance.add_mem_mapping(A.size())};
+            auto b{instance.add_mem_mapping(B.size())};
+            auto c{instance.add_mem_mapping(C.size())};
+            instance.add_transfer_step()->to_device(a)->to_device(b);
+            auto step{instance.add_compute_step()
+                ->load_shader(matmul_shader)
+                ->set_inputs({a, b})
+                ->set_outputs({c})
+                ->set_workgroup_dims(n, n, 1)};
+            step->build();
+            instance.add_transfer_step()->from_device(c);
+            a->copy_from(A.data(), A.size());
+            b->copy_from(B.data(), B.size());
+
+            const double ns{gemm_ns(instance, step, iterations)};
+            c->copy_to(C.data(), C.size());
+            const bool valid{reinterpret_cast<const float*>(C.data() + 3 * sizeof(int))[0] == expected};
+            write_gemm(os, s == 0, n, "matmul", ns, valid);
+        }
+
+        const std::vector<float> A(static_cast<size_t>(n) * n, 1.0f);
+        const std::vector<float> B(static_cast<size_t>(n) * n, 2.0f);
+        std::vector<float> C(static_cast<size_t>(n) * n, 0.0f);
+        const size_t bytes{C.size() * sizeof(float)};
+
+        auto instance{cov::Vulkan::new_instance()};
+        instance.set_profiling(true);
+        auto a{instance.add_mem_mapping(bytes)};
+        auto b{instance.add_mem_mapping(bytes)};
+        auto c{instance.add_mem_mapping(bytes)};
+        instance.add_transfer_step()->to_device(a)->to_device(b);
+        const cov::GemmOptions opts{
+            .m = static_cast<uint32_t>(n),
+            .n = static_cast<uint32_t>(n),
+            .k = static_cast<uint32_t>(n),
+            .shader_path = gemm_shader,
+        };
+        auto step{cov::gemm(instance, a, b, c, opts)};
+        instance.add_transfer_step()->from_device(c);
+        a->copy_from(A.data(), bytes);
+        b->copy_from(B.data(), bytes);
+
+        const double ns{step != nullptr ? gemm_ns(instance, step, iterations) : 0.0};
+        c->copy_to(C.data(), bytes);
+        write_gemm(os, false, n, "gemm", ns, step != nullptr && C.front() == expected && C.back() == expected);
+    }
+    os << "]";
+}
+
+void write_metrics(std::ostream& os, const cov::Metrics& metrics)
+{
+    os << "\"metrics\":{\"submissions\":" << metrics.submissions
+        << ",\"bytes_uploaded\":" << metrics.bytes_uploaded
+        << ",\"bytes_downloaded\":" << metrics.bytes_downloaded
+        << ",\"bytes_copied_in\":" << metrics.bytes_copied_in
+        << ",\"bytes_copied_out\":" << metrics.bytes_copied_out
+        << ",\"dispatches\":" << metrics.dispatches
+        << ",\"workgroups\":" << metrics.workgroups
+        << ",\"descriptor_sets\":" << metrics.descriptor_sets
+        << ",\"pipelines\":" << metrics.pipelines
+        << ",\"wait_us\":" << metrics.wait_ns / 1000.0
+        << ",\"device_allocations\":" << metrics.memory.device_allocations
+        << ",\"device_local_bytes\":" << metrics.memory.device_local_bytes
+        << ",\"host_bytes\":" << metrics.memory.host_bytes << "}";
+}
+
+// host and device spans of a few profiled runs of a matmul graph, and the
+// counters of the instance after them
+void bench_trace(std::ostream& os, const std::string& trace_path)
+{
+    const int n{64};
+    const int iterations{3};
+    const auto A{square_mat(n, 1.0f)};
+    const auto B{square_mat(n, 2.0f)};
+
+    auto instance{cov::Vulkan::new_instance()};
+    instance.set_profiling(true);
+    // the build and the first compile are part of the trace
+    instance.begin_trace();
+    auto a{instance.add_mem_mapping(A.size())};
+    auto b{instance.add_mem_mapping(B.size())};
+    auto c{instance.add_mem_mapping(A.size())};
+    instance.add_transfer_step()->to_device(a)->to_device(b)->build();
+    instance.add_compute_step()
+        ->load_shader(matmul_shader)
+        ->set_inputs({a, b})
+        ->set_outputs({c})
+        ->set_workgroup_dims(n, n, 1)
+        ->build();
+    instance.add_transfer_step()->from_device(c)->build();
+    for (int i = 0; i < iterations; ++i) {
+        a->copy_from(A.data(), A.size());
+        b->copy_from(B.data(), B.size());
+        instance.execute();
+    }
+    const bool written{instance.write_trace(trace_path)};
+
+    os << "\"trace\":{\"path\":\"" << trace_path << "\",\"written\":" << (written ? "true" : "false") << "},\n";
+    write_metrics(os, instance.metrics());
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    cov::Vulkan::init("cov_bench");
+
+    std::ostringstream os;
+    bool unified_memory{false};
+    {
+        auto instance{cov::Vulkan::new_instance()};
+        unified_memory = instance.unified_memory();
+        os << "{\"device\":\"" << instance.device_name() << "\""
+            << ",\"unified_memory\":" << (unified_memory ? "true" : "false")
+            << ",\"transfer_queue\":" << (instance.has_transfer_queue() ? "true" : "false") << ",\n";
+    }
+    bench_transfer(os, unified_memory);
+    os << ",\n";
+    bench_execute_latency(os);
+    os << ",\n";
+    bench_empty_dispatch(os);
+    os << ",\n";
+    bench_pipeline_build(os);
+    os << ",\n";
+    bench_gemm(os);
+    os << ",\n";
+    bench_trace(os, argc > 2 ? argv[2] : "cov_bench.trace.json");
+    os << "}\n";
+
+    if (argc > 1) {
+        std::ofstream ofs(argv[1]);
+        ofs << os.str();
+        return ofs ? 0 : 1;
+    }
+    std::cout << os.str();
+    return 0;
+}
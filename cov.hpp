@@ -2,10 +2,17 @@
 #define COV_H_
 
 #include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <mutex>
 #include <optional>
+#include <span>
+#include <string>
 #include <vector>
 #include <string_view>
+#include <type_traits>
 #include <vulkan/vulkan.h>
 
 #define COV_DEF_SINGLETON(classname)                                            \
@@ -29,6 +36,7 @@ private:
 namespace cov {
 
 class Instance;
+class TraceSpan;
 
 class PhysicalDevice
 {
@@ -36,6 +44,9 @@ public:
     PhysicalDevice();
     bool get(const VkInstance& vk_ins, VkPhysicalDevice& device, uint32_t& queue_index);
     void properties(VkPhysicalDevice device, VkPhysicalDeviceProperties& properties);
+    static bool has_unified_memory(VkPhysicalDevice device);
+    static bool has_extension(VkPhysicalDevice device, const char* ext_name);
+    static std::optional<uint32_t> find_transfer_queue(VkPhysicalDevice device);
 private:
     static std::optional<uint32_t> find_available_queue(VkPhysicalDevice device);
     static bool property_available(VkPhysicalDevice device);
@@ -45,55 +56,193 @@ class Device
 {
 public:
     Device();
-    bool create(VkPhysicalDevice phy_device, uint32_t queue_index, VkDevice& device, VkQueue& queue);
+    bool create(VkPhysicalDevice phy_device, uint32_t queue_index, uint32_t transfer_queue_index,
+        const std::vector<const char*>& extensions, VkDevice& device, VkQueue& queue, VkQueue& transfer_queue);
     void destroy(VkDevice device);
 private:
 }; // class Device
 
-struct MemMapping
+struct Allocation
 {
-    enum AccessStage {
-        AS_UNKNOWN = 0,
-        AS_TRANSFER_R,
-        AS_TRANSFER_W,
-        AS_COMPUTE_R,
-        AS_COMPUTE_W,
-    };
+    VkDeviceMemory memory{VK_NULL_HANDLE};
+    VkDeviceSize offset{0};
+    VkDeviceSize size{0};
+    void* mapped{nullptr};
+    uint32_t block{UINT32_MAX};
+}; // struct Allocation
+
+struct MemoryStats
+{
+    uint32_t block_count;               // live VkDeviceMemory objects
+    uint32_t dedicated_block_count;     // blocks holding a single oversized allocation
+    uint32_t allocation_count;          // live sub-allocations
+    uint64_t device_allocations;        // vkAllocateMemory calls so far
+    VkDeviceSize reserved_bytes;        // total size of live blocks
+    VkDeviceSize used_bytes;            // bytes handed out to buffers
+    VkDeviceSize device_local_bytes;    // used bytes in device local memory
+    VkDeviceSize host_bytes;            // used bytes in host only memory
+    VkDeviceSize largest_free_range;
+}; // struct MemoryStats
+
+// `size` bytes starting `offset` bytes into a buffer
+struct BufferRange
+{
+    VkDeviceSize offset;
+    VkDeviceSize size;
+}; // struct BufferRange
+
+// A configuration of a step tried by the Tuner: the local size, specialized
+// through constant ids 0-2 like ComputeStep::set_local_size(), and further
+// specialization constants such as tile sizes.
+struct TuneConfig
+{
+    std::array<uint32_t, 3> local_size{1, 1, 1};
+    std::vector<std::pair<uint32_t, uint32_t>> spec_constants; // (constant_id, value)
+    double duration_ns{0.0};    // best device time measured by the Tuner
+}; // struct TuneConfig
+
+class MemoryAllocator
+{
+public:
+    MemoryAllocator();
+    void init(VkDevice device, VkPhysicalDevice phy_device, VkDeviceSize block_size);
+    bool allocate(const VkMemoryRequirements& reqs, VkMemoryPropertyFlags property_flags, Allocation& alloc);
+    void free(Allocation& alloc);
+    void destroy();
+    MemoryStats stats() const;
+private:
+    struct Range
+    {
+        VkDeviceSize offset;
+        VkDeviceSize size;
+    }; // struct Range
+
+    struct Block
+    {
+        VkDeviceMemory memory;
+        VkDeviceSize size;
+        VkDeviceSize used;
+        uint32_t memory_type;
+        uint32_t allocation_count;
+        bool dedicated;
+        void* mapped;
+        std::vector<Range> free_ranges; // sorted by offset
+    }; // struct Block
+
+    std::optional<uint32_t> find_memory_type(uint32_t type_bits, VkMemoryPropertyFlags property_flags) const;
+    bool allocate_block(uint32_t memory_type, VkDeviceSize size, bool dedicated, uint32_t& block_index);
+    bool suballocate(uint32_t block_index, const VkMemoryRequirements& reqs, Allocation& alloc);
+    void free_block(uint32_t block_index);
+
+    VkDevice device_;
+    VkPhysicalDeviceMemoryProperties mem_properties_;
+    VkDeviceSize block_size_;
+    std::vector<Block> blocks_;
+    uint64_t device_allocations_;
+}; // class MemoryAllocator
 
+struct MemMapping
+{
     MemMapping(const MemMapping& other);
     MemMapping(MemMapping&& other);
     MemMapping& operator=(const MemMapping& other);
     MemMapping& operator=(MemMapping&& other);
+    // copy_from writes the frame about to be submitted, copy_to reads the
+    // frame submitted last. Both are the same frame unless frames are in flight.
     bool copy_from(const void* ptr, size_t size);
+    bool copy_from(const void* ptr, size_t size, uint32_t frame);
+    bool copy_from(const void* ptr, size_t size, size_t offset, uint32_t frame);
     bool copy_to(void* ptr, size_t size);
+    bool copy_to(void* ptr, size_t size, uint32_t frame);
+    bool copy_to(void* ptr, size_t size, size_t offset, uint32_t frame);
+    uint32_t current_frame() const;
+    uint32_t submitted_frame() const;
+    size_t bytes() const { return size; }
+    // Stream `size` bytes at `file_offset` of a file straight into the staging
+    // memory of the frame about to be submitted, or out of the frame submitted
+    // last. A size of 0 covers the rest of the file, or the whole buffer. False
+    // when the range does not fit the buffer, or the file when loading.
+    bool load_file(std::string_view path, size_t file_offset = 0, size_t size = 0);
+    bool store_file(std::string_view path, size_t file_offset = 0, size_t size = 0);
+
+    // With tracking on, TransferStep::to_device uploads only the ranges written
+    // by copy_from() or marked with mark_dirty() since the frame was last
+    // submitted. Each frame in flight has its own staging and device buffers,
+    // so unless a single frame is in flight every frame must see the writes.
+    MemMapping* track_dirty_ranges(bool enable = true);
+    // a write through host_view()
+    void mark_dirty(size_t offset, size_t size, uint32_t frame);
+
+    // Zero-copy view of the persistently mapped staging memory. Writes land
+    // directly in the buffer consumed by TransferStep::to_device.
+    template<typename T>
+    std::span<T> host_view(uint32_t frame)
+    {
+        return std::span<T>(static_cast<T*>(buffers(frame).host_alloc.mapped), size / sizeof(T));
+    }
+
+    template<typename T>
+    std::span<T> host_view() { return host_view<T>(current_frame()); }
 private:
     friend struct TransferStep;
     friend struct ComputeStep;
     friend class Instance;
 
+    // buffers owned by one frame in flight
+    struct Frame
+    {
+        VkBuffer host_buff;
+        Allocation host_alloc;
+        VkBuffer device_buff;
+        Allocation device_alloc;
+        // where the submissions of this frame left the device buffer, see
+        // Instance::prepare_ownership()
+        uint32_t owner{VK_QUEUE_FAMILY_IGNORED};
+        uint32_t released_to{VK_QUEUE_FAMILY_IGNORED};
+    }; // struct Frame
+
+    // on unified memory the staging buffer is the device buffer
+    bool unified() const;
+    // the bound mapping for an argument slot, this mapping otherwise
+    MemMapping* resolve() const;
+    const Frame& buffers(uint32_t frame) const { return resolve()->frames.at(frame); }
+
     explicit MemMapping(Instance* instance)
         : instance(instance)
-        , host_buff(VK_NULL_HANDLE)
-        , host_memory(VK_NULL_HANDLE)
-        , device_buff(VK_NULL_HANDLE)
-        , device_memory(VK_NULL_HANDLE)
         , size(0)
-        , stage(AS_UNKNOWN) {}
+        , bound(nullptr)
+        , track_dirty(false)
+        , owner(VK_QUEUE_FAMILY_IGNORED)
+        , owner_segment(0)
+        , carried_to(VK_QUEUE_FAMILY_IGNORED) {}
     void destroy();
 
     Instance* instance;
-    VkBuffer host_buff;
-    VkDeviceMemory host_memory;
-    VkBuffer device_buff;
-    VkDeviceMemory device_memory;
+    std::vector<Frame> frames;      // empty for argument slots
     size_t size;
-    AccessStage stage;
+    std::string name;               // set for argument slots only
+    MemMapping* bound;              // mapping an argument slot is bound to
+    bool track_dirty;
+    std::vector<std::vector<BufferRange>> dirty; // per frame, sorted and disjoint
+    std::vector<uint64_t> dirty_versions;        // per frame, Instance::patch_version_ of the last change
+    // queue family owning the device buffers and the segment that last used them,
+    // set by Instance::compile(). A compiled plan leaves the buffers with their
+    // last user, released to `carried_to` when the first user runs on another
+    // family, and the next submission starts from there.
+    uint32_t owner;
+    uint32_t owner_segment;
+    uint32_t carried_to;
 }; // struct MemMapping
 
 struct TransferStep
 {
     TransferStep* to_device(MemMapping* mapping);
+    TransferStep* to_device(MemMapping* mapping, VkDeviceSize offset, VkDeviceSize size);
+    // all ranges in a single vkCmdCopyBuffer
+    TransferStep* to_device(MemMapping* mapping, const std::vector<BufferRange>& ranges);
     TransferStep* from_device(MemMapping* mapping);
+    TransferStep* from_device(MemMapping* mapping, VkDeviceSize offset, VkDeviceSize size);
+    TransferStep* from_device(MemMapping* mapping, const std::vector<BufferRange>& ranges);
     bool build();
     bool destroy() { return true; }
 private:
@@ -106,9 +255,47 @@ private:
 
 struct ComputeStep
 {
+    enum DescriptorLayout {
+        DL_SET_PER_BUFFER = 0,  // buffer i at set = i, binding = 0
+        DL_SINGLE_SET,          // buffer i at set = 0, binding = i
+    }; // enum DescriptorLayout
+
+    ComputeStep* set_descriptor_layout(DescriptorLayout layout);
     ComputeStep* set_inputs(const std::vector<MemMapping*>& input_mappings);
-    ComputeStep* set_outputs(const std::vector<MemMapping*>& output_mappings);
+    // Outputs are read-write, `write_only` drops the read visibility from the
+    // barriers ahead of the step for shaders that never read them.
+    ComputeStep* set_outputs(const std::vector<MemMapping*>& output_mappings, bool write_only = false);
     ComputeStep* set_workgroup_dims(int x, int y, int z);
+    // Read the workgroup counts from a VkDispatchIndirectCommand at `offset`
+    // in the device buffer of `mapping` when the step runs, so an earlier step
+    // can size the dispatch on the device. Replaces set_workgroup_dims().
+    ComputeStep* set_indirect_dims(MemMapping* mapping, VkDeviceSize offset = 0);
+    // Values for the shader's push_constant block. May be called again after
+    // build() with the same size, the next submission uses the new values
+    // without rebuilding the pipeline or re-analysing the step graph. Only the
+    // segment holding the step is recorded again, with record threads only
+    // the slice holding it and the primary command buffer executing it.
+    ComputeStep* set_push_constants(const void* data, uint32_t size);
+    template<typename T>
+    ComputeStep* set_push_constants(const T& value) { return set_push_constants(&value, sizeof(T)); }
+    // Value of the shader's `layout(constant_id = ...)` constant, baked into
+    // the pipeline by build(). bool maps to a 32 bit VkBool32.
+    template<typename T>
+    ComputeStep* specialize(uint32_t constant_id, T value)
+    {
+        static_assert(std::is_arithmetic_v<T>, "Specialization constants are scalars");
+        if constexpr (std::is_same_v<T, bool>) {
+            const VkBool32 bool_value{value ? VK_TRUE : VK_FALSE};
+            return set_spec_constant(constant_id, &bool_value, sizeof(bool_value));
+        } else {
+            return set_spec_constant(constant_id, &value, sizeof(value));
+        }
+    }
+    // Workgroup size for shaders declaring `layout(local_size_x_id = ...)`
+    ComputeStep* set_local_size(uint32_t x, uint32_t y, uint32_t z,
+        uint32_t x_id = 0, uint32_t y_id = 1, uint32_t z_id = 2);
+    // local size and specialization constants picked by the Tuner
+    ComputeStep* apply(const TuneConfig& config);
     ComputeStep* load_shader(const std::string_view& shader_path);
     ComputeStep* load_shader(const void* shader, size_t size);
     bool build();
@@ -116,23 +303,95 @@ private:
     friend class Instance;
     friend class MemMapping;
     explicit ComputeStep(Instance* instance);
-    void destroy(VkDevice device);
+    void destroy();
     bool build_comp_pipeline();
     bool build_descriptor_set();
+    void write_descriptors(uint32_t frame);
+    ComputeStep* set_spec_constant(uint32_t constant_id, const void* data, size_t size);
+    void record(VkCommandBuffer cmd_buf, uint32_t frame) const;
 
     Instance* instance;
     std::vector<MemMapping*> used_mappings;
-    std::vector<VkDescriptorSet> desc_set;
-    std::vector<VkDescriptorSetLayout> desc_set_layout;
-    std::vector<VkBufferMemoryBarrier> mem_buf_barriers;
+    std::vector<MemMapping*> inputs;
+    std::vector<MemMapping*> outputs;
+    std::vector<bool> write_only_outputs;   // per output
+    std::vector<std::vector<VkDescriptorSet>> desc_sets; // per frame
+    std::vector<VkDescriptorSetLayout> desc_set_layout; // owned by the instance
+    VkDescriptorUpdateTemplate update_template;         // owned by the instance
+    bool has_arguments;     // descriptors are written again whenever a frame is re-recorded
     std::array<int, 3> workgroup_dims;
-    VkPipeline comp_pipeline;
-    VkDescriptorPool desc_pool;
+    MemMapping* indirect_mapping;   // nullptr for a direct dispatch
+    VkDeviceSize indirect_offset;
+    std::vector<uint8_t> push_constants;
+    uint64_t push_version;  // Instance::patch_version_ of the last update after build()
+    std::vector<VkSpecializationMapEntry> spec_entries;
+    std::vector<uint8_t> spec_data;
+    DescriptorLayout desc_layout;
+    // owned by the instance caches
+    uint32_t pipeline_index;    // UINT32_MAX until build()
     VkShaderModule shader_module;
     VkPipelineLayout pipeline_layout;
-    VkPipelineCache pipeline_cache;
 }; // struct ComputeStep
 
+// A host array larger than its mapping, moved through it one chunk of
+// mapping->size bytes at a time by Instance::stream()
+struct StreamArray
+{
+    MemMapping* mapping;
+    const void* src;    // uploaded chunk by chunk, nullptr for outputs
+    void* dst;          // downloaded chunk by chunk, nullptr for inputs
+    size_t size;        // bytes of the whole array
+}; // struct StreamArray
+
+// Device time of one step in a profiled submission, relative to the first
+// timestamp written by that submission
+struct StepTiming
+{
+    const ComputeStep* compute_step;    // one of the two is set
+    const TransferStep* transfer_step;
+    double begin_ns;
+    double duration_ns;
+}; // struct StepTiming
+
+// Counters of an instance since its creation, see Instance::metrics()
+struct Metrics
+{
+    uint64_t submissions;
+    uint64_t bytes_uploaded;        // staging to device copies submitted
+    uint64_t bytes_downloaded;      // device to staging copies submitted
+    uint64_t bytes_copied_in;       // host memcpy into staging, copy_from and load_file
+    uint64_t bytes_copied_out;      // host memcpy out of staging, copy_to and store_file
+    uint64_t dispatches;
+    uint64_t workgroups;            // of dispatches with host side dimensions
+    uint64_t descriptor_sets;       // allocated
+    uint64_t pipelines;             // created
+    uint64_t wait_ns;               // blocked in vkWaitForFences
+    MemoryStats memory;             // live allocations and vkAllocateMemory calls
+}; // struct Metrics
+
+// Handle to work submitted with Instance::submit(). Submissions complete in
+// order, the fence backing it is recycled as soon as completion is observed.
+class Submission
+{
+public:
+    bool wait();
+    bool wait_for(uint64_t timeout_ns);
+    bool ready();
+    // false when nothing was submitted because compiling or recording failed,
+    // waiting on it fails as well
+    bool valid() const { return serial != 0; }
+    // the frame whose staging memory holds this submission's results
+    uint32_t frame() const { return frame_index; }
+private:
+    friend class Instance;
+    Submission(Instance* instance, uint64_t serial, uint32_t frame_index)
+        : instance(instance), serial(serial), frame_index(frame_index) {}
+
+    Instance* instance;
+    uint64_t serial;
+    uint32_t frame_index;
+}; // class Submission
+
 class Instance
 {
 public:
@@ -144,15 +403,232 @@ public:
     Instance(Instance&&);
     Instance& operator=(Instance&&);
 
+    // Keep `count` copies of the command buffer and of every mapping's
+    // buffers, rotated per submission, so the host can fill the next frame
+    // while the previous ones execute. Call before adding mappings or steps.
+    void set_frames_in_flight(uint32_t count);
+    uint32_t frames_in_flight() const { return frames_in_flight_; }
+    // Block until the frame about to be submitted is no longer in use and
+    // return its index. Its staging memory is then safe to write.
+    uint32_t begin_frame();
+
     MemMapping* add_mem_mapping(size_t size);
+    // A named slot used by steps in place of a mapping. Bind it to a mapping of
+    // at least `size` bytes before the first submission; binding it again later
+    // only rewrites descriptors and re-records frames, so one compiled graph
+    // serves many sets of buffers, one per frame in flight.
+    MemMapping* add_argument(std::string_view name, size_t size);
+    bool bind(std::string_view name, MemMapping* mapping);
     ComputeStep* add_compute_step();
     TransferStep* add_transfer_step();
+    // Create the pipelines of the steps built so far, analyse the hazards
+    // between them and record the command buffers. Called by submit() when
+    // steps changed since the last call.
+    bool compile();
+    // Worker threads creating pipelines in compile(), defaults to the core count
+    void set_compile_threads(uint32_t count);
+    // Threads recording the command buffers, each into secondary command
+    // buffers from its own pools. 1, the default, records the primary command
+    // buffers directly.
+    void set_record_threads(uint32_t count);
+    // compile() if needed and submit the next frame, an invalid Submission
+    // when compiling or recording fails
+    Submission submit();
     bool execute();
+    // Run the graph once per chunk of `arrays`, each submission on the next
+    // frame in flight: while the device works on the chunks in flight the host
+    // fills the next one and drains the oldest. Copies of the array mappings are
+    // added to the graph, uploads first and downloads last, if it has none yet.
+    // A short last chunk leaves stale bytes past its end in the mapping, so
+    // `prepare(chunk)` should pass the valid size, e.g. as push constants.
+    // Stops at the first copy or submission that fails.
+    bool stream(const std::vector<StreamArray>& arrays, const std::function<void(uint64_t)>& prepare = nullptr);
     void destroy();
+    bool unified_memory() const { return unified_memory_; }
+    // TransferStep work runs on a transfer-only queue family
+    bool has_transfer_queue() const { return transfer_queue_index_ != queue_index_; }
+    std::string device_name() const;
+    VkPhysicalDeviceLimits limits() const;
+    MemoryStats memory_stats() const { return allocator_.stats(); }
+    // Snapshot of the counters, cheap enough to scrape at any rate. The
+    // counters are atomics, the memory stats must not race with allocations.
+    Metrics metrics() const;
+    // Load the pipeline cache from `path` if it was written for this device and
+    // driver, and save it back there when the instance is destroyed. Returns
+    // true when cached data was loaded.
+    bool set_pipeline_cache_path(std::string_view path);
+    bool save_pipeline_cache();
+    // Write a timestamp before and after every step, applied by the next
+    // compile(). Steps on a queue without timestamp support are not timed.
+    void set_profiling(bool enable);
+    // Device time per step of the last submission, waiting for it to complete.
+    // A step spans all of its copies or its dispatch; empty unless profiling.
+    std::vector<StepTiming> profile();
+    // Collect host spans (step builds, compiles, copies, file io, submits and
+    // waits) and, with profiling on, a device span per copy and dispatch,
+    // until write_trace() saves them as Chrome trace JSON for chrome://tracing
+    // or Perfetto. Device spans are placed on the host clock with
+    // VK_EXT_calibrated_timestamps when available, otherwise they start at
+    // their submission.
+    void begin_trace();
+    bool write_trace(std::string_view path);
 private:
+    friend class TraceSpan;
+    friend class Tuner;
     friend struct TransferStep;
     friend struct ComputeStep;
     friend struct MemMapping;
+    friend class Submission;
+
+    struct InFlight
+    {
+        uint64_t serial;
+        VkFence fence;
+        uint32_t frame;
+        uint64_t host_ns;       // submission time, paired with device_ticks when calibrated
+        uint64_t device_ticks;  // UINT64_MAX without calibration
+    }; // struct InFlight
+
+    enum Counter {
+        MC_SUBMISSIONS = 0,
+        MC_BYTES_UPLOADED,
+        MC_BYTES_DOWNLOADED,
+        MC_BYTES_COPIED_IN,
+        MC_BYTES_COPIED_OUT,
+        MC_DISPATCHES,
+        MC_WORKGROUPS,
+        MC_DESCRIPTOR_SETS,
+        MC_PIPELINES,
+        MC_WAIT_NS,
+        MC_COUNT,
+    }; // enum Counter
+
+    // device work recorded into a frame's command buffers, counted per submission
+    struct FrameWork
+    {
+        uint64_t bytes_uploaded;
+        uint64_t bytes_downloaded;
+        uint64_t dispatches;
+        uint64_t workgroups;
+    }; // struct FrameWork
+
+    struct TraceEvent
+    {
+        std::string name;
+        uint32_t track;
+        uint64_t begin_ns;
+        uint64_t end_ns;
+        uint64_t bytes;
+    }; // struct TraceEvent
+
+    // One buffer range touched by a node of the step graph
+    struct Access
+    {
+        MemMapping* mapping;
+        bool host;                      // the staging buffer instead of the device buffer
+        VkDeviceSize offset;
+        VkDeviceSize size;
+        VkPipelineStageFlags2 stage;
+        VkAccessFlags2 access;
+        bool write;
+
+        VkBuffer buffer(uint32_t frame) const;
+        // hazards are tracked per mapping or argument slot, not per bound buffer
+        bool same_buffer(const Access& other) const;
+        bool overlaps(const Access& other) const;
+        bool covers(const Access& other) const;
+    }; // struct Access
+
+    // A hazard on `dst_access` of a node, resolved against `src_access` of `src_node`
+    struct Dependency
+    {
+        uint32_t src_node;
+        uint32_t src_access;
+        uint32_t dst_access;
+    }; // struct Dependency
+
+    struct Node
+    {
+        enum Kind {
+            NK_COPY_TO_DEVICE = 0,
+            NK_COPY_FROM_DEVICE,
+            NK_HOST_READ,       // records nothing, makes device writes visible to the host
+            NK_DISPATCH,
+        }; // enum Kind
+
+        Kind kind;
+        bool transfer;          // recorded on the transfer queue
+        MemMapping* mapping;    // copies
+        std::vector<VkBufferCopy> regions;
+        ComputeStep* step;      // dispatches
+        TransferStep* transfer_step; // copies
+        std::vector<Access> accesses;
+        std::vector<Dependency> deps;
+        uint32_t level;         // longest dependency chain leading to this node
+    }; // struct Node
+
+    // A barrier planned by compile(), its buffer is filled in per frame
+    struct PlannedBarrier
+    {
+        const Access* access;
+        VkBufferMemoryBarrier2 barrier;
+    }; // struct PlannedBarrier
+
+    // Nodes of one dependency level, recorded after a single barrier
+    struct Batch
+    {
+        std::vector<uint32_t> nodes;
+        std::vector<PlannedBarrier> barriers;
+    }; // struct Batch
+
+    // A run of consecutive steps recorded for the same queue. Segments are
+    // submitted in order, each one waiting on the semaphore of the previous.
+    struct Segment
+    {
+        uint32_t queue_index;
+        VkQueue queue;
+        std::vector<Batch> batches;
+        std::vector<PlannedBarrier> releases;  // ownership releases, recorded last
+        std::vector<VkCommandBuffer> cmd_bufs; // per frame
+        // with record threads, slice i covers nodes [slice_starts[i], slice_starts[i + 1])
+        std::vector<uint32_t> slice_starts;
+        std::vector<std::vector<VkCommandBuffer>> secondaries; // per frame, one per slice
+        std::vector<VkSemaphore> semaphores;   // per frame, empty for the last segment
+        std::vector<uint64_t> patch_versions;  // per frame, patch_version_ when it was recorded
+    }; // struct Segment
+
+    // Caches keyed on content, so identical steps share their Vulkan objects
+    struct ShaderModuleEntry
+    {
+        uint64_t hash;
+        std::vector<char> code;
+        VkShaderModule module;
+    }; // struct ShaderModuleEntry
+
+    struct PipelineLayoutEntry
+    {
+        std::vector<VkDescriptorSetLayout> set_layouts;
+        uint32_t push_constant_size;
+        VkPipelineLayout layout;
+    }; // struct PipelineLayoutEntry
+
+    struct PipelineEntry
+    {
+        uint64_t hash;
+        VkShaderModule module;
+        VkPipelineLayout layout;
+        std::vector<uint8_t> spec_key; // (id, size, value) per constant, sorted by id
+        std::vector<VkSpecializationMapEntry> spec_entries;
+        std::vector<uint8_t> spec_data;
+        VkPipeline pipeline;           // VK_NULL_HANDLE until compile()
+    }; // struct PipelineEntry
+
+    // command pools owned by one record thread
+    struct RecordPools
+    {
+        VkCommandPool pool;
+        VkCommandPool transfer_pool;
+    }; // struct RecordPools
 
     enum CmdBufStatus {
         CBS_UNKNOWN = 0,
@@ -162,23 +638,113 @@ private:
 
     VkInstance vk_instance_;
     VkCommandPool cmd_pool_;
+    VkCommandPool transfer_cmd_pool_;
     VkQueue queue_;
+    VkQueue transfer_queue_;
     VkDevice device_;
-    VkCommandBuffer cmd_buf_;
+    std::vector<Segment> segments_;
+    std::vector<Node> nodes_;
     VkPhysicalDevice phy_device_;
-    VkSpecializationInfo spec_info_;
     std::vector<ComputeStep*> comp_steps_;
     std::vector<TransferStep*> transfer_steps_;
     std::vector<MemMapping*> mem_mappings_;
-    std::vector<VkSpecializationMapEntry> spec_map_entryies_;
+    std::vector<VkDescriptorSetLayout> set_layouts_; // indexed by binding count
+    std::vector<VkDescriptorUpdateTemplate> update_templates_; // indexed by binding count
+    std::vector<VkDescriptorPool> desc_pools_;
+    VkPipelineCache pipeline_cache_;
+    std::string pipeline_cache_path_;
+    std::vector<ShaderModuleEntry> shader_modules_;
+    std::vector<std::pair<std::string, VkShaderModule>> shader_paths_;
+    std::vector<PipelineLayoutEntry> pipeline_layouts_;
+    std::vector<PipelineEntry> pipelines_;
+    std::vector<RecordPools> record_pools_; // per record thread
+    std::vector<VkQueryPool> query_pools_;  // per frame while profiling, two timestamps per node
+    uint32_t query_count_;
+    float timestamp_period_;                // nanoseconds per tick
+    uint32_t timestamp_bits_;
+    uint32_t transfer_timestamp_bits_;
+    bool profiling_;
+    std::array<std::atomic<uint64_t>, MC_COUNT> counters_{};
+    std::vector<FrameWork> frame_work_;     // per frame
+    std::vector<TraceEvent> trace_events_;
+    std::mutex trace_mutex_;    // copies may be traced from several threads
+    bool tracing_;
+    PFN_vkGetCalibratedTimestampsEXT get_calibrated_timestamps_;
+    MemoryAllocator allocator_;
+    std::vector<VkFence> fence_pool_;
+    std::deque<InFlight> in_flight_;
+    std::vector<uint64_t> frame_serials_;
+    std::vector<uint64_t> recorded_versions_; // record_version_ each frame was recorded with
+    uint64_t last_serial_;
+    uint64_t record_version_;   // bumped by changes that only need frames re-recorded
+    uint64_t patch_version_;    // bumped by push constant and dirty range changes, see record_patches()
+    uint32_t frames_in_flight_;
+    uint32_t compile_threads_;
+    uint32_t record_threads_;
+    uint32_t frame_;
     uint32_t queue_index_;
+    uint32_t transfer_queue_index_;
     CmdBufStatus cmd_buf_status_;
+    bool unified_memory_;
 
     friend class Vulkan;
     Instance(VkInstance vk_instance);
-    void create_cmd_buf();
-    void try_begin_cmd_buf();
-    void try_end_cmd_buf();
+    static Access whole_buffer(MemMapping* mapping, bool host, VkPipelineStageFlags2 stage,
+        VkAccessFlags2 access, bool write);
+    void add_node(Node&& node);
+    void build_dependencies();
+    void plan_batch(std::span<const uint32_t> batch, std::vector<uint32_t>& node_segment,
+        std::vector<PlannedBarrier>& carried);
+    bool record_frame(uint32_t frame);
+    // records again the segments of a frame holding nodes patched since, see patched()
+    bool record_patches(uint32_t frame);
+    // push constants or dirty ranges of the node changed after `recorded`
+    bool patched(const Node& node, uint32_t frame, uint64_t recorded) const;
+    VkResult record_primary(const Segment& segment, uint32_t frame) const;
+    VkResult record_secondary(const Segment& segment, uint32_t slice, uint32_t frame) const;
+    void record_slice(const Segment& segment, uint32_t first, uint32_t last, VkCommandBuffer cmd_buf, uint32_t frame) const;
+    void split_slices(Segment& segment);
+    void init_record_pools();
+    void destroy_record_pools();
+    void init_query_pools();
+    void destroy_query_pools();
+    bool has_calibrated_timestamps() const;
+    void count(Counter counter, uint64_t n) { counters_.at(counter).fetch_add(n, std::memory_order_relaxed); }
+    // copies a copy node records, only the dirty parts with dirty range tracking
+    std::vector<VkBufferCopy> copy_regions(const Node& node, uint32_t frame) const;
+    void trace(std::string name, uint32_t track, uint64_t begin_ns, uint64_t end_ns, uint64_t bytes = 0);
+    // device spans of a completed submission
+    void trace_device(const InFlight& in_flight);
+    void record_node(const Node& node, VkCommandBuffer cmd_buf, uint32_t frame) const;
+    static void record_barriers(VkCommandBuffer cmd_buf, const std::vector<PlannedBarrier>& barriers, uint32_t frame);
+    void begin_segment(uint32_t queue_index);
+    void reset_segments();
+    // drops the steps, mappings and plan, the device and the caches stay
+    void clear_graph();
+    VkCommandBuffer cmd_buf(uint32_t frame) const { return segments_.back().cmd_bufs.at(frame); }
+    // Moves the mapping to the queue family of the current segment. A release of
+    // the first use in the plan belongs to the previous submission, it goes to
+    // `carried` until the segment using the buffers last is known.
+    bool acquire_mapping(const Access& access, VkBufferMemoryBarrier2& acquire, std::vector<PlannedBarrier>& carried);
+    // Device buffers of a frame may not be where the plan starts from: new ones
+    // belong to no family, others were left by an older plan. Moves them there.
+    bool prepare_ownership(uint32_t frame);
+    bool submit_barriers(uint32_t queue_index, const std::vector<VkBufferMemoryBarrier2>& barriers);
+    // layout of `binding_count` storage buffers at consecutive bindings, shared by all steps
+    VkDescriptorSetLayout get_set_layout(uint32_t binding_count);
+    // writes the buffer infos of all bindings of such a set at once
+    VkDescriptorUpdateTemplate get_update_template(uint32_t binding_count);
+    bool allocate_desc_sets(const std::vector<VkDescriptorSetLayout>& layouts, std::vector<VkDescriptorSet>& sets);
+    bool pipeline_cache_compatible(const std::vector<char>& data) const;
+    VkShaderModule get_shader_module(const void* code, size_t size);
+    VkShaderModule get_shader_module(std::string_view path);
+    VkPipelineLayout get_pipeline_layout(const std::vector<VkDescriptorSetLayout>& set_layouts, uint32_t push_constant_size);
+    // index of the pipeline in pipelines_, it is created by build_pipelines()
+    uint32_t get_pipeline(VkShaderModule module, VkPipelineLayout layout,
+        const std::vector<VkSpecializationMapEntry>& spec_entries, const std::vector<uint8_t>& spec_data);
+    bool build_pipelines();
+    VkFence acquire_fence();
+    bool wait_serial(uint64_t serial, uint64_t timeout_ns);
     static bool init_command_pool(VkDevice device, uint32_t queue_index, VkCommandPool& cmd_pool);
 }; // class Instance
 
@@ -195,6 +761,71 @@ private:
     ~Vulkan() = default;
 }; // class Vulkan
 
+// C = alpha * A * B + beta * C on dense row major float matrices, A is m x k,
+// B is k x n and C is m x n. The step runs the SPIR-V of gemm.comp, which is
+// not part of the header: compile examples/shader/gemm.comp with the
+// application's shaders and pass its path. Each workgroup computes a
+// (wg_y * tm) x (wg_x * tn) tile of C through shared memory, each invocation
+// a tm x tn block of it in registers.
+struct GemmOptions
+{
+    uint32_t m{0};
+    uint32_t n{0};
+    uint32_t k{0};
+    float alpha{1.0f};
+    float beta{0.0f};
+    std::string shader_path;    // required, the compiled gemm.comp
+    uint32_t wg_x{16};      // local size along the columns of C
+    uint32_t wg_y{16};      // local size along the rows of C
+    uint32_t tm{4};         // rows of C per invocation
+    uint32_t tn{4};         // columns of C per invocation
+    uint32_t bk{16};        // depth of the shared memory tiles
+    bool vectorize{true};   // vec4 loads when k, n, bk and wg_x * tn are multiples of 4
+}; // struct GemmOptions
+
+// Adds and builds the GEMM step reading A and B and writing C, or returns
+// nullptr when the shader cannot be built.
+ComputeStep* gemm(Instance& instance, MemMapping* A, MemMapping* B, MemMapping* C, const GemmOptions& opts);
+
+// Times candidate configurations of a step on the device and keeps the fastest
+// per problem key, e.g. the shape. With a path the choices persist in a file
+// written for one device and driver, so later runs start tuned.
+class Tuner
+{
+public:
+    using StepFactory = std::function<ComputeStep*(Instance& instance, const TuneConfig& config)>;
+
+    // Candidates run one after the other on `instance`, which holds no steps or
+    // mappings of its own and outlives the tuner
+    explicit Tuner(Instance& instance, std::string_view path = "");
+    Tuner* set_iterations(uint32_t iterations);
+    // The stored choice for `key`, otherwise the fastest of `candidates`, which
+    // is stored and saved. `add_step` sets up the instance with the step to
+    // time, its mappings and transfers, and applies the config to the step;
+    // they are dropped once timed. Candidates beyond the workgroup limits of the
+    // device are skipped, and all of them fail on queues without timestamps.
+    std::optional<TuneConfig> tune(std::string_view key, const std::vector<TuneConfig>& candidates,
+        const StepFactory& add_step);
+    std::optional<TuneConfig> find(std::string_view key) const;
+    const VkPhysicalDeviceLimits& limits() const { return limits_; }
+    bool save() const;
+private:
+    bool load();
+    bool fits(const TuneConfig& config) const;
+    // best device time of the step over the iterations, negative on failure
+    double measure(const TuneConfig& config, const StepFactory& add_step);
+
+    Instance* instance_;
+    std::string path_;
+    std::string header_;        // format version, vendor, device, driver and pipeline cache UUID
+    VkPhysicalDeviceLimits limits_;
+    uint32_t iterations_;
+    std::vector<std::pair<std::string, TuneConfig>> results_;
+}; // class Tuner
+
+// `opts` with the fastest tiles for its shape, timed on first use
+GemmOptions tune_gemm(Tuner& tuner, const GemmOptions& opts);
+
 } // namespace cov
 
 #endif // COV_H_
@@ -209,25 +840,55 @@ private:
 #ifndef COV_IMPLEMENTATION_CPP_
 #define COV_IMPLEMENTATION_CPP_
 
+#include <algorithm>
+#include <chrono>
 #include <ios>
+#include <numeric>
 #include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <cstring>
 #include <cassert>
 #include <cstddef>
+#include <cstdio>
 #include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+#include <thread>
 #include <vector>
 #include <mutex>
 #include <cstring>
 #include <iostream>
 
+#if defined(__unix__) || defined(__APPLE__)
+#   define COV_HAS_MMAP 1
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#else
+#   define COV_HAS_MMAP 0
+#endif
+
 #ifdef COV_VULKAN_VALIDATION
 #   define COV_ENABLE_VALIDATION 1
 #else // COV_VULKAN_VALIDATION
 #   define COV_ENABLE_VALIDATION 0
 #endif // COV_VULKAN_VALIDATION
 
+#ifndef COV_MEMORY_BLOCK_SIZE
+#   define COV_MEMORY_BLOCK_SIZE (64ull << 20)
+#endif // COV_MEMORY_BLOCK_SIZE
+
+#ifndef COV_FILE_CHUNK_SIZE
+#   define COV_FILE_CHUNK_SIZE (16ull << 20) // bytes copied between page cache releases
+#endif // COV_FILE_CHUNK_SIZE
+
+#ifndef COV_DESCRIPTOR_POOL_SIZE
+#   define COV_DESCRIPTOR_POOL_SIZE 256 // sets per shared pool
+#endif // COV_DESCRIPTOR_POOL_SIZE
+
 
 #define CHECK_VALIDATION_AVAILABLE()                                            \
     do {                                                                        \
@@ -259,8 +920,54 @@ const std::vector<const char*> cov_validation_layers = {
 
 std::string stringify(VkResult result);
 
-bool create_buffer(VkDevice device, VkPhysicalDevice phy_device, size_t size, VkBufferUsageFlags usage,
-    VkMemoryPropertyFlags property_flags, VkBuffer& buff, VkDeviceMemory& memory);
+// FNV-1a, used to key the shader module and pipeline caches
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+    const auto bytes{static_cast<const uint8_t*>(data)};
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+bool create_buffer(VkDevice device, MemoryAllocator& allocator, size_t size, VkBufferUsageFlags usage,
+    VkMemoryPropertyFlags property_flags, VkBuffer& buff, Allocation& alloc);
+
+// steady_clock is CLOCK_MONOTONIC, the host domain device timestamps are calibrated against
+inline uint64_t host_time_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// trace tracks, one per timeline
+constexpr uint32_t COV_TRACK_HOST{0};
+constexpr uint32_t COV_TRACK_QUEUE{1};
+constexpr uint32_t COV_TRACK_TRANSFER_QUEUE{2};
+
+// Host span of the instance trace, from construction to destruction
+class TraceSpan
+{
+public:
+    TraceSpan(Instance* instance, const char* name, uint64_t bytes = 0)
+        : instance_(instance != nullptr && instance->tracing_ ? instance : nullptr)
+        , name_(name)
+        , bytes_(bytes)
+        , begin_ns_(instance_ != nullptr ? host_time_ns() : 0) {}
+    ~TraceSpan()
+    {
+        if (instance_ != nullptr) {
+            instance_->trace(name_, COV_TRACK_HOST, begin_ns_, host_time_ns(), bytes_);
+        }
+    }
+    // for sizes known only once the span runs
+    void set_bytes(uint64_t bytes) { bytes_ = bytes; }
+private:
+    Instance* instance_;
+    const char* name_;
+    uint64_t bytes_;
+    uint64_t begin_ns_;
+}; // class TraceSpan
 
 class LayerExtensions
 {
@@ -311,48 +1018,155 @@ Instance Vulkan::new_instance()
 Instance::Instance(VkInstance vk_instance)
     : vk_instance_(vk_instance)
     , cmd_pool_(VK_NULL_HANDLE)
+    , transfer_cmd_pool_(VK_NULL_HANDLE)
     , queue_(VK_NULL_HANDLE)
-    , phy_device_(VK_NULL_HANDLE)
+    , transfer_queue_(VK_NULL_HANDLE)
     , device_(VK_NULL_HANDLE)
-    , cmd_buf_(VK_NULL_HANDLE)
+    , phy_device_(VK_NULL_HANDLE)
+    , pipeline_cache_(VK_NULL_HANDLE)
+    , query_count_(0)
+    , timestamp_period_(1.0f)
+    , timestamp_bits_(0)
+    , transfer_timestamp_bits_(0)
+    , profiling_(false)
+    , frame_work_(1, FrameWork{})
+    , tracing_(false)
+    , get_calibrated_timestamps_(nullptr)
+    , frame_serials_(1, 0)
+    , recorded_versions_(1, 0)
+    , last_serial_(0)
+    , record_version_(0)
+    , patch_version_(0)
+    , frames_in_flight_(1)
+    , compile_threads_(std::max(std::thread::hardware_concurrency(), 1u))
+    , record_threads_(1)
+    , frame_(0)
     , queue_index_(-1)
+    , transfer_queue_index_(-1)
     , cmd_buf_status_(CBS_UNKNOWN)
+    , unified_memory_(false)
 {
     PhysicalDevice physical_device_creator;
     Device device_creator;
 
     physical_device_creator.get(vk_instance_, phy_device_, queue_index_);
-    device_creator.create(phy_device_, queue_index_, device_, queue_);
+    unified_memory_ = PhysicalDevice::has_unified_memory(phy_device_);
+    // with unified memory there are no copies worth moving to another queue
+    const auto transfer_queue_index{PhysicalDevice::find_transfer_queue(phy_device_)};
+    transfer_queue_index_ = transfer_queue_index.has_value() && !unified_memory_ ?
+        transfer_queue_index.value() : queue_index_;
+    // traces place device timestamps on the host clock
+    std::vector<const char*> extensions;
+    const bool calibrated_timestamps{has_calibrated_timestamps()};
+    if (calibrated_timestamps) {
+        extensions.push_back(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+    }
+    device_creator.create(phy_device_, queue_index_, transfer_queue_index_, extensions, device_, queue_, transfer_queue_);
+    if (calibrated_timestamps) {
+        get_calibrated_timestamps_ = reinterpret_cast<PFN_vkGetCalibratedTimestampsEXT>(
+            vkGetDeviceProcAddr(device_, "vkGetCalibratedTimestampsEXT"));
+    }
     init_command_pool(device_, queue_index_, cmd_pool_);
+    if (has_transfer_queue()) {
+        init_command_pool(device_, transfer_queue_index_, transfer_cmd_pool_);
+    }
+    allocator_.init(device_, phy_device_, COV_MEMORY_BLOCK_SIZE);
+
+    VkPhysicalDeviceProperties properties;
+    physical_device_creator.properties(phy_device_, properties);
+    timestamp_period_ = properties.limits.timestampPeriod;
+    uint32_t family_count{0};
+    vkGetPhysicalDeviceQueueFamilyProperties(phy_device_, &family_count, nullptr);
+    std::vector<VkQueueFamilyProperties> families(family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(phy_device_, &family_count, families.data());
+    timestamp_bits_ = families.at(queue_index_).timestampValidBits;
+    transfer_timestamp_bits_ = families.at(transfer_queue_index_).timestampValidBits;
 
-    spec_info_.dataSize = 0;
-    spec_info_.pData = nullptr;
-    spec_info_.mapEntryCount = 0;
-    spec_info_.pMapEntries = nullptr;
+    VkPipelineCacheCreateInfo pipeline_cache_create_info{};
+    pipeline_cache_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    COV_CHECK_ASSERT(vkCreatePipelineCache(device_, &pipeline_cache_create_info, nullptr, &pipeline_cache_))
 }
 
 Instance::Instance(Instance&& other)
 {
     vk_instance_ = other.vk_instance_;
     cmd_pool_ = other.cmd_pool_;
-    mem_mappings_ = other.mem_mappings_;
+    transfer_cmd_pool_ = other.transfer_cmd_pool_;
+    mem_mappings_ = std::move(other.mem_mappings_);
     queue_ = other.queue_;
+    transfer_queue_ = other.transfer_queue_;
     phy_device_ = other.phy_device_;
     device_ = other.device_;
     queue_index_ = other.queue_index_;
-    spec_info_ = other.spec_info_;
-    spec_map_entryies_ = other.spec_map_entryies_;
+    transfer_queue_index_ = other.transfer_queue_index_;
+    set_layouts_ = std::move(other.set_layouts_);
+    update_templates_ = std::move(other.update_templates_);
+    desc_pools_ = std::move(other.desc_pools_);
+    pipeline_cache_ = other.pipeline_cache_;
+    pipeline_cache_path_ = std::move(other.pipeline_cache_path_);
+    shader_modules_ = std::move(other.shader_modules_);
+    shader_paths_ = std::move(other.shader_paths_);
+    pipeline_layouts_ = std::move(other.pipeline_layouts_);
+    pipelines_ = std::move(other.pipelines_);
+    allocator_ = std::move(other.allocator_);
+    fence_pool_ = std::move(other.fence_pool_);
+    in_flight_ = std::move(other.in_flight_);
+    segments_ = std::move(other.segments_);
+    nodes_ = std::move(other.nodes_);
+    comp_steps_ = std::move(other.comp_steps_);
+    transfer_steps_ = std::move(other.transfer_steps_);
+    frame_serials_ = std::move(other.frame_serials_);
+    recorded_versions_ = std::move(other.recorded_versions_);
+    last_serial_ = other.last_serial_;
+    record_version_ = other.record_version_;
+    patch_version_ = other.patch_version_;
+    frames_in_flight_ = other.frames_in_flight_;
+    compile_threads_ = other.compile_threads_;
+    record_threads_ = other.record_threads_;
+    record_pools_ = std::move(other.record_pools_);
+    query_pools_ = std::move(other.query_pools_);
+    query_count_ = other.query_count_;
+    timestamp_period_ = other.timestamp_period_;
+    timestamp_bits_ = other.timestamp_bits_;
+    transfer_timestamp_bits_ = other.transfer_timestamp_bits_;
+    profiling_ = other.profiling_;
+    for (size_t i = 0; i < counters_.size(); ++i) {
+        counters_.at(i).store(other.counters_.at(i).load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    frame_work_ = std::move(other.frame_work_);
+    trace_events_ = std::move(other.trace_events_);
+    tracing_ = other.tracing_;
+    get_calibrated_timestamps_ = other.get_calibrated_timestamps_;
+    frame_ = other.frame_;
     cmd_buf_status_ = other.cmd_buf_status_;
+    unified_memory_ = other.unified_memory_;
+    // the graph points back at its instance, the plan into nodes_ which kept its storage
+    for (auto mapping : mem_mappings_) {
+        mapping->instance = this;
+    }
+    for (auto step : comp_steps_) {
+        step->instance = this;
+    }
+    for (auto step : transfer_steps_) {
+        step->instance = this;
+    }
 
     other.vk_instance_ = VK_NULL_HANDLE;
     other.cmd_pool_ = VK_NULL_HANDLE;
+    other.transfer_cmd_pool_ = VK_NULL_HANDLE;
     other.queue_ = VK_NULL_HANDLE;
+    other.transfer_queue_ = VK_NULL_HANDLE;
     other.phy_device_ = VK_NULL_HANDLE;
     other.device_ = VK_NULL_HANDLE;
+    other.pipeline_cache_ = VK_NULL_HANDLE;
     other.queue_index_ = -1;
     other.mem_mappings_.clear();
-    other.spec_map_entryies_.clear();
-    cmd_buf_status_ = CBS_UNKNOWN;
+    other.comp_steps_.clear();
+    other.transfer_steps_.clear();
+    other.nodes_.clear();
+    other.segments_.clear();
+    other.in_flight_.clear();
+    other.cmd_buf_status_ = CBS_UNKNOWN;
 }
 
 Instance& Instance::operator=(Instance&& other)
@@ -364,33 +1178,108 @@ Instance& Instance::operator=(Instance&& other)
     destroy();
     vk_instance_ = other.vk_instance_;
     cmd_pool_ = other.cmd_pool_;
-    mem_mappings_ = other.mem_mappings_;
+    transfer_cmd_pool_ = other.transfer_cmd_pool_;
+    mem_mappings_ = std::move(other.mem_mappings_);
     queue_ = other.queue_;
+    transfer_queue_ = other.transfer_queue_;
     phy_device_ = other.phy_device_;
     device_ = other.device_;
     queue_index_ = other.queue_index_;
-    spec_info_ = other.spec_info_;
-    spec_map_entryies_ = other.spec_map_entryies_;
+    transfer_queue_index_ = other.transfer_queue_index_;
+    set_layouts_ = std::move(other.set_layouts_);
+    update_templates_ = std::move(other.update_templates_);
+    desc_pools_ = std::move(other.desc_pools_);
+    pipeline_cache_ = other.pipeline_cache_;
+    pipeline_cache_path_ = std::move(other.pipeline_cache_path_);
+    shader_modules_ = std::move(other.shader_modules_);
+    shader_paths_ = std::move(other.shader_paths_);
+    pipeline_layouts_ = std::move(other.pipeline_layouts_);
+    pipelines_ = std::move(other.pipelines_);
+    allocator_ = std::move(other.allocator_);
+    fence_pool_ = std::move(other.fence_pool_);
+    in_flight_ = std::move(other.in_flight_);
+    segments_ = std::move(other.segments_);
+    nodes_ = std::move(other.nodes_);
+    comp_steps_ = std::move(other.comp_steps_);
+    transfer_steps_ = std::move(other.transfer_steps_);
+    frame_serials_ = std::move(other.frame_serials_);
+    recorded_versions_ = std::move(other.recorded_versions_);
+    last_serial_ = other.last_serial_;
+    record_version_ = other.record_version_;
+    patch_version_ = other.patch_version_;
+    frames_in_flight_ = other.frames_in_flight_;
+    compile_threads_ = other.compile_threads_;
+    record_threads_ = other.record_threads_;
+    record_pools_ = std::move(other.record_pools_);
+    query_pools_ = std::move(other.query_pools_);
+    query_count_ = other.query_count_;
+    timestamp_period_ = other.timestamp_period_;
+    timestamp_bits_ = other.timestamp_bits_;
+    transfer_timestamp_bits_ = other.transfer_timestamp_bits_;
+    profiling_ = other.profiling_;
+    for (size_t i = 0; i < counters_.size(); ++i) {
+        counters_.at(i).store(other.counters_.at(i).load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+    frame_work_ = std::move(other.frame_work_);
+    trace_events_ = std::move(other.trace_events_);
+    tracing_ = other.tracing_;
+    get_calibrated_timestamps_ = other.get_calibrated_timestamps_;
+    frame_ = other.frame_;
     cmd_buf_status_ = other.cmd_buf_status_;
+    unified_memory_ = other.unified_memory_;
+    // the graph points back at its instance, the plan into nodes_ which kept its storage
+    for (auto mapping : mem_mappings_) {
+        mapping->instance = this;
+    }
+    for (auto step : comp_steps_) {
+        step->instance = this;
+    }
+    for (auto step : transfer_steps_) {
+        step->instance = this;
+    }
 
     other.vk_instance_ = VK_NULL_HANDLE;
     other.cmd_pool_ = VK_NULL_HANDLE;
+    other.transfer_cmd_pool_ = VK_NULL_HANDLE;
     other.queue_ = VK_NULL_HANDLE;
+    other.transfer_queue_ = VK_NULL_HANDLE;
     other.phy_device_ = VK_NULL_HANDLE;
     other.device_ = VK_NULL_HANDLE;
+    other.pipeline_cache_ = VK_NULL_HANDLE;
     other.queue_index_ = -1;
     other.mem_mappings_.clear();
-    other.spec_map_entryies_.clear();
-    cmd_buf_status_ = CBS_UNKNOWN;
+    other.comp_steps_.clear();
+    other.transfer_steps_.clear();
+    other.nodes_.clear();
+    other.segments_.clear();
+    other.in_flight_.clear();
+    other.cmd_buf_status_ = CBS_UNKNOWN;
 
     return *this;
 }
 
 void Instance::destroy()
 {
+    if (device_) {
+        wait_serial(last_serial_, UINT64_MAX);
+        for (auto fence : fence_pool_) {
+            vkDestroyFence(device_, fence, nullptr);
+        }
+    }
+    fence_pool_.clear();
+
+    if (device_) {
+        reset_segments();
+        destroy_record_pools();
+        destroy_query_pools();
+    }
+
     if (device_ && cmd_pool_) {
         vkDestroyCommandPool(device_, cmd_pool_, nullptr);
     }
+    if (device_ && transfer_cmd_pool_) {
+        vkDestroyCommandPool(device_, transfer_cmd_pool_, nullptr);
+    }
 
     for (const auto& mapping : mem_mappings_) {
         mapping->destroy();
@@ -399,7 +1288,7 @@ void Instance::destroy()
     mem_mappings_.clear();
 
     for (auto& step : comp_steps_) {
-        step->destroy(device_);
+        step->destroy();
         delete step;
     }
     comp_steps_.clear();
@@ -410,14 +1299,71 @@ void Instance::destroy()
     }
     transfer_steps_.clear();
 
+    for (const auto& entry : pipelines_) {
+        vkDestroyPipeline(device_, entry.pipeline, nullptr);
+    }
+    pipelines_.clear();
+    for (const auto& entry : pipeline_layouts_) {
+        vkDestroyPipelineLayout(device_, entry.layout, nullptr);
+    }
+    pipeline_layouts_.clear();
+    for (const auto& entry : shader_modules_) {
+        vkDestroyShaderModule(device_, entry.module, nullptr);
+    }
+    shader_modules_.clear();
+    shader_paths_.clear();
+
+    for (auto pool : desc_pools_) {
+        vkDestroyDescriptorPool(device_, pool, nullptr);
+    }
+    desc_pools_.clear();
+    for (auto layout : set_layouts_) {
+        if (layout != VK_NULL_HANDLE) {
+            vkDestroyDescriptorSetLayout(device_, layout, nullptr);
+        }
+    }
+    set_layouts_.clear();
+    for (auto update_template : update_templates_) {
+        if (update_template != VK_NULL_HANDLE) {
+            vkDestroyDescriptorUpdateTemplate(device_, update_template, nullptr);
+        }
+    }
+    update_templates_.clear();
+
+    if (device_ && pipeline_cache_) {
+        if (!pipeline_cache_path_.empty()) {
+            save_pipeline_cache();
+        }
+        vkDestroyPipelineCache(device_, pipeline_cache_, nullptr);
+        pipeline_cache_ = VK_NULL_HANDLE;
+    }
+    allocator_.destroy();
+
     if (device_) {
         vkDestroyDevice(device_, nullptr);
     }
     if (vk_instance_) {
         vkDestroyInstance(vk_instance_, nullptr);
     }
+}
+
+void Instance::set_frames_in_flight(uint32_t count)
+{
+    assert(count > 0 && "Bad frame count");
+    assert(mem_mappings_.empty() && cmd_buf_status_ == CBS_UNKNOWN &&
+        "Frames in flight must be set before adding mappings or steps");
+
+    frames_in_flight_ = count;
+    frame_serials_.assign(count, 0);
+    recorded_versions_.assign(count, 0);
+    frame_work_.assign(count, FrameWork{});
+    frame_ = 0;
+}
 
-    spec_map_entryies_.clear();
+uint32_t Instance::begin_frame()
+{
+    wait_serial(frame_serials_.at(frame_), UINT64_MAX);
+    return frame_;
 }
 
 MemMapping* Instance::add_mem_mapping(size_t size)
@@ -428,462 +1374,2687 @@ MemMapping* Instance::add_mem_mapping(size_t size)
     auto mapping{mem_mappings_.back()};
 
     mapping->size = size;
-    create_buffer(device_, phy_device_, size,
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, mapping->host_buff, mapping->host_memory);
-    create_buffer(device_, phy_device_, size,
-        VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mapping->device_buff, mapping->device_memory);
+    mapping->frames.resize(frames_in_flight_);
+    mapping->dirty.resize(frames_in_flight_);
+    mapping->dirty_versions.assign(frames_in_flight_, 0);
+    for (auto& frame : mapping->frames) {
+        if (unified_memory_) {
+            create_buffer(device_, allocator_, size,
+                VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                    VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                frame.device_buff, frame.device_alloc);
+            frame.host_buff = frame.device_buff;
+            frame.host_alloc = frame.device_alloc;
+        } else {
+            create_buffer(device_, allocator_, size,
+                VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                frame.host_buff, frame.host_alloc);
+            create_buffer(device_, allocator_, size,
+                VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                    VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, frame.device_buff, frame.device_alloc);
+        }
+    }
 
     return mapping;
 }
 
-void Instance::create_cmd_buf()
+MemMapping* Instance::add_argument(std::string_view name, size_t size)
 {
-    if (cmd_buf_ != VK_NULL_HANDLE) {
-        return;
-    }
-    VkCommandBufferAllocateInfo cmd_buf_alloc_info{};
-    cmd_buf_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    cmd_buf_alloc_info.commandBufferCount = 1;
-    cmd_buf_alloc_info.commandPool = cmd_pool_;
-    cmd_buf_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    COV_CHECK_ASSERT(vkAllocateCommandBuffers(device_, &cmd_buf_alloc_info, &cmd_buf_))
+    assert(size > 0 && "Bad buffer size");
+    assert(!name.empty() && "Arguments need a name");
+
+    mem_mappings_.push_back(new MemMapping{this});
+    auto argument{mem_mappings_.back()};
+    argument->size = size;
+    argument->name = name;
+    return argument;
 }
 
-void Instance::try_begin_cmd_buf()
+bool Instance::bind(std::string_view name, MemMapping* mapping)
 {
-    if (cmd_buf_status_ == CBS_UNKNOWN) {
-        create_cmd_buf();
-        VkCommandBufferBeginInfo cmd_begin_info{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
-        COV_CHECK_ASSERT(vkBeginCommandBuffer(cmd_buf_, &cmd_begin_info));
-        cmd_buf_status_ = CBS_BEGAN;
+    assert(mapping != nullptr && mapping->name.empty() && "Arguments are bound to mappings");
+
+    auto it{std::find_if(mem_mappings_.begin(), mem_mappings_.end(), [&](const MemMapping* m) {
+        return m->name == name;
+    })};
+    if (it == mem_mappings_.end()) {
+        return false;
+    }
+    auto argument{*it};
+    assert(mapping->size >= argument->size && "Mapping smaller than the argument");
+    if (argument->bound == mapping) {
+        return true;
     }
+    for (auto other : mem_mappings_) {
+        // the plan orders accesses per slot, two slots sharing buffers would race
+        assert((other == argument || other->bound != mapping) && "Mapping bound to another argument");
+    }
+
+    argument->bound = mapping;
+    // descriptors, copies and barriers of each frame are updated before its next submission
+    ++record_version_;
+    return true;
 }
 
-void Instance::try_end_cmd_buf()
+void Instance::begin_segment(uint32_t queue_index)
 {
-    if (cmd_buf_status_ == CBS_BEGAN) {
-        COV_CHECK_ASSERT(vkEndCommandBuffer(cmd_buf_));    
-        cmd_buf_status_ = CBS_ENDED;
+    // the previous segment now has a successor to signal
+    if (!segments_.empty()) {
+        auto& prev{segments_.back()};
+        prev.semaphores.resize(frames_in_flight_);
+        VkSemaphoreCreateInfo semaphore_create_info{.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO};
+        for (auto& semaphore : prev.semaphores) {
+            COV_CHECK_ASSERT(vkCreateSemaphore(device_, &semaphore_create_info, nullptr, &semaphore))
+        }
     }
+
+    auto& segment{segments_.emplace_back()};
+    segment.queue_index = queue_index;
+    segment.queue = queue_index == queue_index_ ? queue_ : transfer_queue_;
+    segment.cmd_bufs.resize(frames_in_flight_);
+    segment.patch_versions.assign(frames_in_flight_, 0);
+
+    VkCommandBufferAllocateInfo cmd_buf_alloc_info{};
+    cmd_buf_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd_buf_alloc_info.commandBufferCount = frames_in_flight_;
+    cmd_buf_alloc_info.commandPool = queue_index == queue_index_ ? cmd_pool_ : transfer_cmd_pool_;
+    cmd_buf_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    COV_CHECK_ASSERT(vkAllocateCommandBuffers(device_, &cmd_buf_alloc_info, segment.cmd_bufs.data()))
 }
 
-bool Instance::execute()
+void Instance::reset_segments()
 {
-    try_end_cmd_buf();
+    if (segments_.empty()) {
+        return;
+    }
 
-    VkFence fence;
-    VkFenceCreateInfo fence_create_info{};
-    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fence_create_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
-    COV_CHECK_ASSERT(vkCreateFence(device_, &fence_create_info, nullptr, &fence))
+    // the command buffers may still be pending
+    wait_serial(last_serial_, UINT64_MAX);
+    for (const auto& segment : segments_) {
+        for (auto semaphore : segment.semaphores) {
+            vkDestroySemaphore(device_, semaphore, nullptr);
+        }
+        vkFreeCommandBuffers(device_, segment.queue_index == queue_index_ ? cmd_pool_ : transfer_cmd_pool_,
+            static_cast<uint32_t>(segment.cmd_bufs.size()), segment.cmd_bufs.data());
+        for (const auto& frame_secondaries : segment.secondaries) {
+            for (size_t w = 0; w < frame_secondaries.size(); ++w) {
+                const auto& pools{record_pools_.at(w)};
+                vkFreeCommandBuffers(device_, segment.queue_index == queue_index_ ? pools.pool : pools.transfer_pool,
+                    1, &frame_secondaries.at(w));
+            }
+        }
+    }
+    segments_.clear();
+}
 
-    vkResetFences(device_, 1, &fence);
+void Instance::clear_graph()
+{
+    // pending submissions may still use them
+    wait_serial(last_serial_, UINT64_MAX);
+    reset_segments();
+    destroy_query_pools();
+    nodes_.clear();
 
-    const VkPipelineStageFlags wait_stage_mask{VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT};
-    VkSubmitInfo submit_info{};
-    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &cmd_buf_;
-    submit_info.pWaitDstStageMask = &wait_stage_mask;
-    COV_CHECK_ASSERT(vkQueueSubmit(queue_, 1, &submit_info, fence))
-    COV_CHECK_ASSERT(vkWaitForFences(device_, 1, &fence, VK_TRUE, UINT64_MAX))
+    for (const auto& mapping : mem_mappings_) {
+        mapping->destroy();
+        delete mapping;
+    }
+    mem_mappings_.clear();
 
-    vkDestroyFence(device_, fence, nullptr);
-    return true;
-}
+    for (auto& step : comp_steps_) {
+        step->destroy();
+        delete step;
+    }
+    comp_steps_.clear();
 
-bool Instance::init_command_pool(VkDevice device, uint32_t queue_index, VkCommandPool& cmd_pool)
-{
-    VkCommandPoolCreateInfo create_info{};
-    create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    create_info.queueFamilyIndex = queue_index;
-    create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    for (auto& step : transfer_steps_) {
+        step->destroy();
+        delete step;
+    }
+    transfer_steps_.clear();
 
-    if (vkCreateCommandPool(device, &create_info, nullptr, &cmd_pool) != VK_SUCCESS) {
-        return false;
+    // frees the descriptor sets of the dropped steps
+    for (auto pool : desc_pools_) {
+        vkResetDescriptorPool(device_, pool, 0);
     }
-    return true;
+    cmd_buf_status_ = CBS_UNKNOWN;
 }
 
-TransferStep* Instance::add_transfer_step()
+Instance::Access Instance::whole_buffer(MemMapping* mapping, bool host, VkPipelineStageFlags2 stage,
+    VkAccessFlags2 access, bool write)
 {
-    transfer_steps_.push_back(new TransferStep{this});
-    auto step{transfer_steps_.back()};
-    return step;
+    return Access{
+        .mapping = mapping,
+        .host = host,
+        .offset = 0,
+        .size = mapping->size,
+        .stage = stage,
+        .access = access,
+        .write = write,
+    };
 }
 
-ComputeStep* Instance::add_compute_step()
+VkBuffer Instance::Access::buffer(uint32_t frame) const
 {
-    comp_steps_.push_back(new ComputeStep{this});
-    auto step{comp_steps_.back()};
-    return step;
+    const auto& buffs{mapping->buffers(frame)};
+    return host ? buffs.host_buff : buffs.device_buff;
 }
 
-void MemMapping::destroy()
+bool Instance::Access::same_buffer(const Access& other) const
 {
-    vkDestroyBuffer(instance->device_, device_buff, nullptr);
-    vkDestroyBuffer(instance->device_, host_buff, nullptr);
-    vkFreeMemory(instance->device_, device_memory, nullptr);
-    vkFreeMemory(instance->device_, host_memory, nullptr);
+    // on unified memory the host and device side alias the same buffer
+    return mapping == other.mapping && (host == other.host || mapping->unified());
 }
 
-MemMapping::MemMapping(const MemMapping& other)
+bool Instance::Access::overlaps(const Access& other) const
 {
-    instance = other.instance;
-    host_buff = other.host_buff;
-    host_memory = other.host_memory;
-    device_buff = other.device_buff;
-    device_memory = other.device_memory;
-    size = other.size;
+    return same_buffer(other) && offset < other.offset + other.size && other.offset < offset + size;
 }
 
-MemMapping::MemMapping(MemMapping&& other)
+bool Instance::Access::covers(const Access& other) const
 {
-    instance = other.instance;
-    host_buff = other.host_buff;
-    host_memory = other.host_memory;
-    device_buff = other.device_buff;
-    device_memory = other.device_memory;
-    size = other.size;
-
-    instance = nullptr;
-    host_buff = VK_NULL_HANDLE;
-    host_memory = VK_NULL_HANDLE;
-    device_buff = VK_NULL_HANDLE;
-    device_memory = VK_NULL_HANDLE;
-    size = 0;
+    return same_buffer(other) && offset <= other.offset && other.offset + other.size <= offset + size;
 }
 
-MemMapping& MemMapping::operator=(const MemMapping& other)
+void Instance::add_node(Node&& node)
 {
-    instance = other.instance;
-    host_buff = other.host_buff;
-    host_memory = other.host_memory;
-    device_buff = other.device_buff;
-    device_memory = other.device_memory;
-    size = other.size;
-    return *this;
+    nodes_.push_back(std::move(node));
+    // record again on the next submission
+    cmd_buf_status_ = CBS_UNKNOWN;
 }
 
-MemMapping& MemMapping::operator=(MemMapping&& other)
+void Instance::build_dependencies()
 {
-    instance = nullptr;
-    host_buff = VK_NULL_HANDLE;
-    host_memory = VK_NULL_HANDLE;
-    device_buff = VK_NULL_HANDLE;
-    device_memory = VK_NULL_HANDLE;
-    size = 0;
-    return *this;
+    for (uint32_t i = 0; i < nodes_.size(); ++i) {
+        auto& node{nodes_.at(i)};
+        node.deps.clear();
+        node.level = 0;
+
+        for (uint32_t a = 0; a < node.accesses.size(); ++a) {
+            const auto& access{node.accesses.at(a)};
+            // walk back to the closest write covering the range, anything
+            // older is already ordered before that write
+            bool covered{false};
+            for (uint32_t j = i; j-- > 0 && !covered;) {
+                const auto& prev{nodes_.at(j)};
+                for (uint32_t b = 0; b < prev.accesses.size(); ++b) {
+                    const auto& prev_access{prev.accesses.at(b)};
+                    if (!prev_access.overlaps(access) || (!prev_access.write && !access.write)) {
+                        continue;
+                    }
+                    // RAW, WAR or WAW
+                    node.deps.push_back(Dependency{.src_node = j, .src_access = b, .dst_access = a});
+                    node.level = std::max(node.level, prev.level + 1);
+                    covered = covered || (prev_access.write && prev_access.covers(access));
+                }
+            }
+        }
+    }
 }
 
-bool MemMapping::copy_from(const void* ptr, size_t size)
+bool Instance::compile()
 {
-    assert(ptr != nullptr && "Invalid pointer");
-    assert(size > 0 && "Invalid buffer size");
-    assert(size <= this->size && "Invalid buffer size greate than pre-allocated buffer size");
+    if (cmd_buf_status_ == CBS_ENDED) {
+        return true;
+    }
+    TraceSpan span{this, "compile"};
 
-    void* mapped_data;
-    VkMappedMemoryRange mem_range{.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE};
-    vkMapMemory(instance->device_, host_memory, 0, size, 0, &mapped_data);
-    memcpy(mapped_data, ptr, size);
-    vkUnmapMemory(instance->device_, host_memory);
-    return true;
-}
+    if (!build_pipelines()) {
+        return false;
+    }
+    reset_segments();
+    build_dependencies();
+    destroy_query_pools();
+    if (profiling_) {
+        init_query_pools();
+    }
 
-bool MemMapping::copy_to(void* ptr, size_t size)
-{
-    assert(ptr != nullptr && "Invalid pointer");
-    assert(size > 0 && "Invalid buffer size");
-    assert(size <= this->size && "Invalid buffer size greate than pre-allocated buffer size");
+    // Record level by level. Nodes on the same level are independent and run
+    // concurrently, those on the queue used last go first to save a segment.
+    std::vector<uint32_t> order(nodes_.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+        return nodes_.at(a).level < nodes_.at(b).level;
+    });
+    bool transfer{false};
+    for (auto first{order.begin()}; first != order.end();) {
+        const uint32_t level{nodes_.at(*first).level};
+        const auto last{std::find_if(first, order.end(), [&](uint32_t i) { return nodes_.at(i).level != level; })};
+        std::stable_partition(first, last, [&](uint32_t i) { return nodes_.at(i).transfer == transfer; });
+        transfer = nodes_.at(*std::prev(last)).transfer;
+        first = last;
+    }
 
-    void* mapped_data;
-    vkMapMemory(instance->device_, host_memory, 0, size, 0, &mapped_data);
-    memcpy(ptr, mapped_data, size);
-    vkUnmapMemory(instance->device_, host_memory);
-    return true;
-}
+    // each submission starts where the one before left the buffers, with their last user
+    for (auto mapping : mem_mappings_) {
+        mapping->owner = VK_QUEUE_FAMILY_IGNORED;
+        mapping->owner_segment = UINT32_MAX;
+        mapping->carried_to = VK_QUEUE_FAMILY_IGNORED;
+    }
+    for (auto i : order) {
+        for (const auto& access : nodes_.at(i).accesses) {
+            if (!access.host && !access.mapping->unified()) {
+                access.mapping->owner = nodes_.at(i).transfer ? transfer_queue_index_ : queue_index_;
+            }
+        }
+    }
 
-TransferStep* TransferStep::to_device(MemMapping* mapping)
-{
-    assert(mapping != nullptr && "Invalid memory mapping");
+    cmd_buf_status_ = CBS_BEGAN;
+    std::vector<uint32_t> node_segment(nodes_.size());
+    std::vector<PlannedBarrier> carried;
+    for (auto first{order.begin()}; first != order.end();) {
+        const auto& head{nodes_.at(*first)};
+        const auto last{std::find_if(first, order.end(), [&](uint32_t i) {
+            return nodes_.at(i).level != head.level || nodes_.at(i).transfer != head.transfer;
+        })};
+        plan_batch(std::span<const uint32_t>(first, last), node_segment, carried);
+        first = last;
+    }
+    // released for the next submission by the segment using the buffers last
+    for (const auto& release : carried) {
+        segments_.at(release.access->mapping->owner_segment).releases.push_back(release);
+    }
 
-    instance->try_begin_cmd_buf();
-    VkBufferCopy copy_region{.size = mapping->size};
-    vkCmdCopyBuffer(instance->cmd_buf_, mapping->host_buff, mapping->device_buff, 1, &copy_region);
-    mapping->stage = MemMapping::AS_TRANSFER_W;
-    return this;
+    if (record_threads_ > 1) {
+        init_record_pools();
+        for (auto& segment : segments_) {
+            split_slices(segment);
+        }
+    }
+
+    for (uint32_t f = 0; f < frames_in_flight_; ++f) {
+        if (!record_frame(f)) {
+            return false;
+        }
+    }
+    recorded_versions_.assign(frames_in_flight_, record_version_);
+    cmd_buf_status_ = CBS_ENDED;
+    return true;
 }
 
-TransferStep* TransferStep::from_device(MemMapping* mapping)
+bool Instance::record_frame(uint32_t frame)
 {
-    assert(mapping != nullptr && "Invalid memory mapping");
+    TraceSpan span{this, "record"};
+    // arguments may have been rebound, the frame is not pending here
+    for (auto step : comp_steps_) {
+        if (step->has_arguments && step->pipeline_index != UINT32_MAX) {
+            step->write_descriptors(frame);
+        }
+    }
 
-    instance->try_begin_cmd_buf();
-
-    VkBufferCopy copy_region{.size = mapping->size};
-    VkPipelineStageFlags src_stage_bit{};
-    VkBufferMemoryBarrier mem_barrier{
-        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
-        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
-        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
-        .buffer = mapping->device_buff,
-        .size = VK_WHOLE_SIZE,
-    };
+    // the pools allow resetting single command buffers, begin does it implicitly
+    if (record_threads_ > 1) {
+        std::vector<VkResult> results(record_threads_, VK_SUCCESS);
+        auto worker = [&](uint32_t w) {
+            for (const auto& segment : segments_) {
+                if (w >= segment.secondaries.at(frame).size()) {
+                    continue;
+                }
+                results.at(w) = record_secondary(segment, w, frame);
+                if (results.at(w) != VK_SUCCESS) {
+                    return;
+                }
+            }
+        };
 
-    if (mapping->stage == MemMapping::AS_TRANSFER_W) {
-        src_stage_bit = VK_PIPELINE_STAGE_TRANSFER_BIT;
-        mem_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    } else if (mapping->stage == MemMapping::AS_COMPUTE_W) {
-        src_stage_bit = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
-        mem_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-    } else {
-        mem_barrier.srcAccessMask = VK_ACCESS_NONE;
+        std::vector<std::thread> workers;
+        for (uint32_t w = 1; w < record_threads_; ++w) {
+            workers.emplace_back(worker, w);
+        }
+        worker(0);
+        for (auto& t : workers) {
+            t.join();
+        }
+        for (auto result : results) {
+            COV_CHECK_FALSE(result)
+        }
     }
 
-    if (mem_barrier.srcAccessMask != VK_ACCESS_NONE) {
-        vkCmdPipelineBarrier(instance->cmd_buf_, src_stage_bit, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
-            0, nullptr,
-            1, &mem_barrier,
-            0, nullptr);
+    for (auto& segment : segments_) {
+        COV_CHECK_FALSE(record_primary(segment, frame))
+        segment.patch_versions.at(frame) = patch_version_;
     }
 
-    vkCmdCopyBuffer(instance->cmd_buf_, mapping->device_buff, mapping->host_buff, 1, &copy_region);
-    mapping->stage = MemMapping::AS_TRANSFER_R;
-    return this;
+    auto& work{frame_work_.at(frame)};
+    work = FrameWork{};
+    for (const auto& node : nodes_) {
+        if (node.kind == Node::NK_DISPATCH) {
+            ++work.dispatches;
+            if (node.step->indirect_mapping == nullptr) {
+                const auto& dims{node.step->workgroup_dims};
+                work.workgroups += static_cast<uint64_t>(dims.at(0)) * dims.at(1) * dims.at(2);
+            }
+        } else if (node.kind != Node::NK_HOST_READ) {
+            auto& bytes{node.kind == Node::NK_COPY_TO_DEVICE ? work.bytes_uploaded : work.bytes_downloaded};
+            for (const auto& region : copy_regions(node, frame)) {
+                bytes += region.size;
+            }
+        }
+    }
+    return true;
 }
 
-bool TransferStep::build()
+// Push constants live in the recorded commands. Instead of the whole frame,
+// record again the segments holding steps updated since the frame was
+// recorded, with record threads only their stale slices plus the primary
+// command buffer, which has to be re-recorded to execute them.
+bool Instance::record_patches(uint32_t frame)
 {
+    for (auto& segment : segments_) {
+        const uint64_t recorded{segment.patch_versions.at(frame)};
+        if (recorded == patch_version_) {
+            continue;
+        }
+
+        const size_t num_slices{segment.secondaries.empty() ? 0 : segment.secondaries.at(frame).size()};
+        std::vector<bool> stale_slices(num_slices, false);
+        bool stale{false};
+        uint32_t position{0};
+        for (const auto& batch : segment.batches) {
+            for (auto i : batch.nodes) {
+                const auto& node{nodes_.at(i)};
+                if (patched(node, frame, recorded)) {
+                    stale = true;
+                    if (num_slices > 0) {
+                        const auto it{std::upper_bound(segment.slice_starts.begin(), segment.slice_starts.end(), position)};
+                        stale_slices.at(std::distance(segment.slice_starts.begin(), it) - 1) = true;
+                    }
+                }
+                ++position;
+            }
+        }
+
+        if (stale) {
+            TraceSpan span{this, "record"};
+            for (uint32_t w = 0; w < num_slices; ++w) {
+                if (stale_slices.at(w)) {
+                    COV_CHECK_FALSE(record_secondary(segment, w, frame))
+                }
+            }
+            COV_CHECK_FALSE(record_primary(segment, frame))
+        }
+        segment.patch_versions.at(frame) = patch_version_;
+    }
     return true;
 }
 
-ComputeStep::ComputeStep(Instance* instance)
-    : instance(instance)
-    , workgroup_dims({1, 1, 1})
+bool Instance::patched(const Node& node, uint32_t frame, uint64_t recorded) const
 {
+    if (node.kind == Node::NK_DISPATCH) {
+        return node.step->push_version > recorded;
+    }
+    if (node.kind == Node::NK_COPY_TO_DEVICE) {
+        const auto target{node.mapping->resolve()};
+        return target->track_dirty && target->dirty_versions.at(frame) > recorded;
+    }
+    return false;
 }
 
-ComputeStep* ComputeStep::load_shader(const std::string_view& shader_path)
+VkResult Instance::record_primary(const Segment& segment, uint32_t frame) const
 {
-    std::ifstream ifs(shader_path.data(), std::ios::in | std::ios::binary);
-    if (ifs.is_open()) {
-        ifs.seekg(0, std::ios::end);
-        const auto size{ifs.tellg()};
-        char* data{new char[size]};
-        ifs.seekg(0, std::ios::beg);
-        ifs.read(data, size);
-        load_shader(data, size);
-        delete [] data;
+    VkCommandBufferBeginInfo cmd_begin_info{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO};
+    const auto cmd_buf{segment.cmd_bufs.at(frame)};
+    const VkResult result{vkBeginCommandBuffer(cmd_buf, &cmd_begin_info)};
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    if (segment.secondaries.empty()) {
+        record_slice(segment, 0, UINT32_MAX, cmd_buf, frame);
     } else {
-        assert(false && "Load shader fro file failed");
+        // the slices run in order, as if recorded inline
+        const auto& secondaries{segment.secondaries.at(frame)};
+        vkCmdExecuteCommands(cmd_buf, static_cast<uint32_t>(secondaries.size()), secondaries.data());
     }
+    record_barriers(cmd_buf, segment.releases, frame);
+    return vkEndCommandBuffer(cmd_buf);
+}
+
+VkResult Instance::record_secondary(const Segment& segment, uint32_t slice, uint32_t frame) const
+{
+    VkCommandBufferInheritanceInfo inheritance_info{.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO};
+    VkCommandBufferBeginInfo cmd_begin_info{
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .pInheritanceInfo = &inheritance_info,
+    };
+    const auto cmd_buf{segment.secondaries.at(frame).at(slice)};
+    const VkResult result{vkBeginCommandBuffer(cmd_buf, &cmd_begin_info)};
+    if (result != VK_SUCCESS) {
+        return result;
+    }
+    record_slice(segment, segment.slice_starts.at(slice), segment.slice_starts.at(slice + 1), cmd_buf, frame);
+    return vkEndCommandBuffer(cmd_buf);
+}
+
+void Instance::record_slice(const Segment& segment, uint32_t first, uint32_t last, VkCommandBuffer cmd_buf,
+    uint32_t frame) const
+{
+    // a batch's barrier goes to the slice holding the first node of the batch
+    uint32_t position{0};
+    for (const auto& batch : segment.batches) {
+        const uint32_t batch_end{position + static_cast<uint32_t>(batch.nodes.size())};
+        if (position >= first && position < last) {
+            record_barriers(cmd_buf, batch.barriers, frame);
+        }
+        for (uint32_t p = std::max(position, first); p < std::min(batch_end, last); ++p) {
+            record_node(nodes_.at(batch.nodes.at(p - position)), cmd_buf, frame);
+        }
+        position = batch_end;
+    }
+}
+
+void Instance::split_slices(Segment& segment)
+{
+    uint32_t num_nodes{0};
+    for (const auto& batch : segment.batches) {
+        num_nodes += static_cast<uint32_t>(batch.nodes.size());
+    }
+
+    const uint32_t num_slices{std::min(record_threads_, num_nodes)};
+    segment.slice_starts.resize(num_slices + 1);
+    for (uint32_t w = 0; w <= num_slices; ++w) {
+        segment.slice_starts.at(w) = w * num_nodes / num_slices;
+    }
+
+    // slice w is recorded by thread w, from that thread's pools only
+    segment.secondaries.assign(frames_in_flight_, std::vector<VkCommandBuffer>(num_slices));
+    for (uint32_t w = 0; w < num_slices; ++w) {
+        const auto& pools{record_pools_.at(w)};
+        VkCommandBufferAllocateInfo cmd_buf_alloc_info{};
+        cmd_buf_alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        cmd_buf_alloc_info.commandBufferCount = 1;
+        cmd_buf_alloc_info.commandPool = segment.queue_index == queue_index_ ? pools.pool : pools.transfer_pool;
+        cmd_buf_alloc_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        for (auto& frame_secondaries : segment.secondaries) {
+            COV_CHECK_ASSERT(vkAllocateCommandBuffers(device_, &cmd_buf_alloc_info, &frame_secondaries.at(w)))
+        }
+    }
+}
+
+void Instance::init_record_pools()
+{
+    if (record_pools_.size() == record_threads_) {
+        return;
+    }
+
+    destroy_record_pools();
+    record_pools_.resize(record_threads_, RecordPools{.pool = VK_NULL_HANDLE, .transfer_pool = VK_NULL_HANDLE});
+    for (auto& pools : record_pools_) {
+        init_command_pool(device_, queue_index_, pools.pool);
+        if (has_transfer_queue()) {
+            init_command_pool(device_, transfer_queue_index_, pools.transfer_pool);
+        }
+    }
+}
+
+void Instance::destroy_record_pools()
+{
+    for (const auto& pools : record_pools_) {
+        vkDestroyCommandPool(device_, pools.pool, nullptr);
+        if (pools.transfer_pool != VK_NULL_HANDLE) {
+            vkDestroyCommandPool(device_, pools.transfer_pool, nullptr);
+        }
+    }
+    record_pools_.clear();
+}
+
+void Instance::init_query_pools()
+{
+    query_count_ = 2 * static_cast<uint32_t>(nodes_.size());
+    if (query_count_ == 0) {
+        return;
+    }
+
+    VkQueryPoolCreateInfo query_pool_create_info{};
+    query_pool_create_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    query_pool_create_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    query_pool_create_info.queryCount = query_count_;
+    query_pools_.resize(frames_in_flight_);
+    for (auto& pool : query_pools_) {
+        COV_CHECK_ASSERT(vkCreateQueryPool(device_, &query_pool_create_info, nullptr, &pool))
+        vkResetQueryPool(device_, pool, 0, query_count_);
+    }
+}
+
+void Instance::destroy_query_pools()
+{
+    for (auto pool : query_pools_) {
+        vkDestroyQueryPool(device_, pool, nullptr);
+    }
+    query_pools_.clear();
+    query_count_ = 0;
+}
+
+void Instance::set_profiling(bool enable)
+{
+    profiling_ = enable;
+    // record again on the next submission
+    cmd_buf_status_ = CBS_UNKNOWN;
+}
+
+std::vector<StepTiming> Instance::profile()
+{
+    std::vector<StepTiming> timings;
+    if (query_pools_.empty() || last_serial_ == 0) {
+        return timings;
+    }
+    const uint32_t frame{(frame_ + frames_in_flight_ - 1) % frames_in_flight_};
+    if (!wait_serial(frame_serials_.at(frame), UINT64_MAX)) {
+        return timings;
+    }
+
+    // (timestamp, availability) per query, nodes without timestamps stay unavailable
+    std::vector<uint64_t> results(2 * query_count_);
+    const auto result{vkGetQueryPoolResults(device_, query_pools_.at(frame), 0, query_count_,
+        results.size() * sizeof(uint64_t), results.data(), 2 * sizeof(uint64_t),
+        VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT)};
+    if (result != VK_SUCCESS && result != VK_NOT_READY) {
+        return timings;
+    }
+
+    uint64_t origin{UINT64_MAX};
+    for (uint32_t q = 0; q < query_count_; ++q) {
+        if (results.at(2 * q + 1) != 0) {
+            origin = std::min(origin, results.at(2 * q));
+        }
+    }
+    for (uint32_t i = 0; i < query_count_ / 2; ++i) {
+        if (results.at(4 * i + 1) == 0 || results.at(4 * i + 3) == 0) {
+            continue;
+        }
+        const auto& node{nodes_.at(i)};
+        const double begin{static_cast<double>(results.at(4 * i) - origin) * timestamp_period_};
+        const double end{static_cast<double>(results.at(4 * i + 2) - origin) * timestamp_period_};
+        const ComputeStep* compute_step{node.kind == Node::NK_DISPATCH ? node.step : nullptr};
+        auto it{std::find_if(timings.begin(), timings.end(), [&](const StepTiming& timing) {
+            return timing.compute_step == compute_step && timing.transfer_step == node.transfer_step;
+        })};
+        if (it == timings.end()) {
+            timings.push_back(StepTiming{
+                .compute_step = compute_step,
+                .transfer_step = node.transfer_step,
+                .begin_ns = begin,
+                .duration_ns = end - begin,
+            });
+            continue;
+        }
+        const double merged_end{std::max(it->begin_ns + it->duration_ns, end)};
+        it->begin_ns = std::min(it->begin_ns, begin);
+        it->duration_ns = merged_end - it->begin_ns;
+    }
+    return timings;
+}
+
+std::string Instance::device_name() const
+{
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(phy_device_, &properties);
+    return properties.deviceName;
+}
+
+VkPhysicalDeviceLimits Instance::limits() const
+{
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(phy_device_, &properties);
+    return properties.limits;
+}
+
+Metrics Instance::metrics() const
+{
+    auto counter = [this](Counter c) { return counters_.at(c).load(std::memory_order_relaxed); };
+    return Metrics{
+        .submissions = counter(MC_SUBMISSIONS),
+        .bytes_uploaded = counter(MC_BYTES_UPLOADED),
+        .bytes_downloaded = counter(MC_BYTES_DOWNLOADED),
+        .bytes_copied_in = counter(MC_BYTES_COPIED_IN),
+        .bytes_copied_out = counter(MC_BYTES_COPIED_OUT),
+        .dispatches = counter(MC_DISPATCHES),
+        .workgroups = counter(MC_WORKGROUPS),
+        .descriptor_sets = counter(MC_DESCRIPTOR_SETS),
+        .pipelines = counter(MC_PIPELINES),
+        .wait_ns = counter(MC_WAIT_NS),
+        .memory = allocator_.stats(),
+    };
+}
+
+bool Instance::has_calibrated_timestamps() const
+{
+    if (!PhysicalDevice::has_extension(phy_device_, VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME)) {
+        return false;
+    }
+    const auto get_time_domains{reinterpret_cast<PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT>(
+        vkGetInstanceProcAddr(vk_instance_, "vkGetPhysicalDeviceCalibrateableTimeDomainsEXT"))};
+    if (get_time_domains == nullptr) {
+        return false;
+    }
+
+    uint32_t count{0};
+    get_time_domains(phy_device_, &count, nullptr);
+    std::vector<VkTimeDomainEXT> domains(count);
+    get_time_domains(phy_device_, &count, domains.data());
+    return std::find(domains.begin(), domains.end(), VK_TIME_DOMAIN_DEVICE_EXT) != domains.end() &&
+        std::find(domains.begin(), domains.end(), VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT) != domains.end();
+}
+
+void Instance::begin_trace()
+{
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    trace_events_.clear();
+    tracing_ = true;
+}
+
+void Instance::trace(std::string name, uint32_t track, uint64_t begin_ns, uint64_t end_ns, uint64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    trace_events_.push_back(TraceEvent{
+        .name = std::move(name),
+        .track = track,
+        .begin_ns = begin_ns,
+        .end_ns = end_ns,
+        .bytes = bytes,
+    });
+}
+
+void Instance::trace_device(const InFlight& in_flight)
+{
+    std::vector<uint64_t> results(2 * query_count_);
+    const auto result{vkGetQueryPoolResults(device_, query_pools_.at(in_flight.frame), 0, query_count_,
+        results.size() * sizeof(uint64_t), results.data(), 2 * sizeof(uint64_t),
+        VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT)};
+    if (result != VK_SUCCESS && result != VK_NOT_READY) {
+        return;
+    }
+
+    // without calibration the first timestamp is placed at the submission
+    uint64_t origin{in_flight.device_ticks};
+    if (origin == UINT64_MAX) {
+        for (uint32_t q = 0; q < query_count_; ++q) {
+            if (results.at(2 * q + 1) != 0) {
+                origin = std::min(origin, results.at(2 * q));
+            }
+        }
+    }
+    auto to_host = [&](uint64_t ticks) -> uint64_t {
+        const double delta_ns{static_cast<double>(static_cast<int64_t>(ticks - origin)) * timestamp_period_};
+        return static_cast<uint64_t>(static_cast<double>(in_flight.host_ns) + delta_ns);
+    };
+
+    for (uint32_t i = 0; i < query_count_ / 2; ++i) {
+        if (results.at(4 * i + 1) == 0 || results.at(4 * i + 3) == 0) {
+            continue;
+        }
+        const auto& node{nodes_.at(i)};
+        std::string name;
+        if (node.kind == Node::NK_DISPATCH) {
+            name = "dispatch " + std::to_string(
+                std::find(comp_steps_.begin(), comp_steps_.end(), node.step) - comp_steps_.begin());
+        } else {
+            name = std::string(node.kind == Node::NK_COPY_TO_DEVICE ? "to_device " : "from_device ") + std::to_string(
+                std::find(transfer_steps_.begin(), transfer_steps_.end(), node.transfer_step) - transfer_steps_.begin());
+        }
+        trace(std::move(name), node.transfer ? COV_TRACK_TRANSFER_QUEUE : COV_TRACK_QUEUE,
+            to_host(results.at(4 * i)), to_host(results.at(4 * i + 2)));
+    }
+}
+
+bool Instance::write_trace(std::string_view path)
+{
+    std::lock_guard<std::mutex> lock(trace_mutex_);
+    tracing_ = false;
+
+    std::ofstream ofs(std::string(path), std::ios::out | std::ios::trunc);
+    if (!ofs.is_open()) {
+        return false;
+    }
+
+    uint64_t origin{UINT64_MAX};
+    for (const auto& event : trace_events_) {
+        origin = std::min(origin, event.begin_ns);
+    }
+    // complete events in microseconds relative to the first span
+    ofs << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    const std::array<const char*, 3> track_names{"host", "queue", "transfer queue"};
+    for (uint32_t t = 0; t < track_names.size(); ++t) {
+        ofs << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":" << t
+            << ",\"args\":{\"name\":\"" << track_names.at(t) << "\"}},\n";
+    }
+    ofs.setf(std::ios::fixed);
+    ofs.precision(3);
+    for (size_t i = 0; i < trace_events_.size(); ++i) {
+        const auto& event{trace_events_.at(i)};
+        ofs << "{\"name\":\"" << event.name << "\",\"cat\":\""
+            << (event.track == COV_TRACK_HOST ? "host" : "device") << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << event.track
+            << ",\"ts\":" << static_cast<double>(event.begin_ns - origin) / 1000.0
+            << ",\"dur\":" << static_cast<double>(event.end_ns - std::min(event.end_ns, event.begin_ns)) / 1000.0;
+        if (event.bytes != 0) {
+            ofs << ",\"args\":{\"bytes\":" << event.bytes << "}";
+        }
+        ofs << "}" << (i + 1 < trace_events_.size() ? ",\n" : "\n");
+    }
+    ofs << "]}\n";
+    trace_events_.clear();
+    return static_cast<bool>(ofs);
+}
+
+void Instance::set_record_threads(uint32_t count)
+{
+    assert(count > 0 && "Bad thread count");
+    record_threads_ = count;
+    // record again on the next submission
+    cmd_buf_status_ = CBS_UNKNOWN;
+}
+
+void Instance::record_barriers(VkCommandBuffer cmd_buf, const std::vector<PlannedBarrier>& barriers, uint32_t frame)
+{
+    if (barriers.empty()) {
+        return;
+    }
+
+    std::vector<VkBufferMemoryBarrier2> frame_barriers(barriers.size());
+    for (size_t i = 0; i < barriers.size(); ++i) {
+        frame_barriers.at(i) = barriers.at(i).barrier;
+        frame_barriers.at(i).buffer = barriers.at(i).access->buffer(frame);
+    }
+    VkDependencyInfo dependency_info{
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .bufferMemoryBarrierCount = static_cast<uint32_t>(frame_barriers.size()),
+        .pBufferMemoryBarriers = frame_barriers.data(),
+    };
+    vkCmdPipelineBarrier2(cmd_buf, &dependency_info);
+}
+
+void Instance::plan_batch(std::span<const uint32_t> batch, std::vector<uint32_t>& node_segment,
+    std::vector<PlannedBarrier>& carried)
+{
+    const uint32_t queue_index{nodes_.at(batch.front()).transfer ? transfer_queue_index_ : queue_index_};
+    if (segments_.empty() || segments_.back().queue_index != queue_index) {
+        begin_segment(queue_index);
+    }
+    const uint32_t segment{static_cast<uint32_t>(segments_.size() - 1)};
+
+    // one barrier per buffer
+    std::vector<PlannedBarrier> barriers;
+    std::vector<const Access*> acquired;
+
+    // an ownership acquire replaces the hazard barriers of its buffer
+    for (auto i : batch) {
+        for (const auto& access : nodes_.at(i).accesses) {
+            VkBufferMemoryBarrier2 acquire{};
+            if (acquire_mapping(access, acquire, carried)) {
+                barriers.push_back(PlannedBarrier{.access = &access, .barrier = acquire});
+                acquired.push_back(&access);
+            }
+        }
+    }
+
+    for (auto i : batch) {
+        const auto& node{nodes_.at(i)};
+        for (const auto& dep : node.deps) {
+            // earlier segments are ordered by the semaphore between segments
+            if (node_segment.at(dep.src_node) != segment) {
+                continue;
+            }
+
+            const auto& src{nodes_.at(dep.src_node).accesses.at(dep.src_access)};
+            const auto& dst{node.accesses.at(dep.dst_access)};
+            if (std::any_of(acquired.begin(), acquired.end(), [&](const Access* a) { return a->same_buffer(dst); })) {
+                continue;
+            }
+
+            // a write-after-read only needs an execution dependency
+            const VkAccessFlags2 src_access{src.write ? src.access : VK_ACCESS_2_NONE};
+            const VkAccessFlags2 dst_access{src.write ? dst.access : VK_ACCESS_2_NONE};
+            const VkDeviceSize begin{std::min(src.offset, dst.offset)};
+            const VkDeviceSize end{std::max(src.offset + src.size, dst.offset + dst.size)};
+            auto it{std::find_if(barriers.begin(), barriers.end(), [&](const PlannedBarrier& b) {
+                return b.access->same_buffer(dst);
+            })};
+            if (it == barriers.end()) {
+                barriers.push_back(PlannedBarrier{
+                    .access = &dst,
+                    .barrier = VkBufferMemoryBarrier2{
+                        .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                        .srcStageMask = src.stage,
+                        .srcAccessMask = src_access,
+                        .dstStageMask = dst.stage,
+                        .dstAccessMask = dst_access,
+                        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                        .offset = begin,
+                        .size = end - begin,
+                    },
+                });
+                continue;
+            }
+
+            auto& barrier{it->barrier};
+            const VkDeviceSize merged_begin{std::min(barrier.offset, begin)};
+            barrier.srcStageMask |= src.stage;
+            barrier.srcAccessMask |= src_access;
+            barrier.dstStageMask |= dst.stage;
+            barrier.dstAccessMask |= dst_access;
+            barrier.size = std::max(barrier.offset + barrier.size, end) - merged_begin;
+            barrier.offset = merged_begin;
+        }
+    }
+
+    segments_.back().batches.push_back(Batch{
+        .nodes = std::vector<uint32_t>(batch.begin(), batch.end()),
+        .barriers = std::move(barriers),
+    });
+    for (auto i : batch) {
+        node_segment.at(i) = segment;
+    }
+}
+
+void Instance::record_node(const Node& node, VkCommandBuffer cmd_buf, uint32_t frame) const
+{
+    const uint32_t query{2 * static_cast<uint32_t>(&node - nodes_.data())};
+    const bool timed{!query_pools_.empty() && node.kind != Node::NK_HOST_READ &&
+        (node.transfer ? transfer_timestamp_bits_ : timestamp_bits_) > 0};
+    if (timed) {
+        vkCmdWriteTimestamp2(cmd_buf, VK_PIPELINE_STAGE_2_TOP_OF_PIPE_BIT, query_pools_.at(frame), query);
+    }
+
+    switch (node.kind) {
+    case Node::NK_COPY_TO_DEVICE: {
+        const auto& buffs{node.mapping->buffers(frame)};
+        const auto regions{copy_regions(node, frame)};
+        if (!regions.empty()) {
+            vkCmdCopyBuffer(cmd_buf, buffs.host_buff, buffs.device_buff, static_cast<uint32_t>(regions.size()), regions.data());
+        }
+        break;
+    }
+    case Node::NK_COPY_FROM_DEVICE: {
+        const auto& buffs{node.mapping->buffers(frame)};
+        vkCmdCopyBuffer(cmd_buf, buffs.device_buff, buffs.host_buff,
+            static_cast<uint32_t>(node.regions.size()), node.regions.data());
+        break;
+    }
+    case Node::NK_DISPATCH:
+        node.step->record(cmd_buf, frame);
+        break;
+    case Node::NK_HOST_READ:
+        break;
+    }
+
+    if (timed) {
+        vkCmdWriteTimestamp2(cmd_buf, VK_PIPELINE_STAGE_2_BOTTOM_OF_PIPE_BIT, query_pools_.at(frame), query + 1);
+    }
+}
+
+std::vector<VkBufferCopy> Instance::copy_regions(const Node& node, uint32_t frame) const
+{
+    const auto target{node.mapping->resolve()};
+    if (node.kind != Node::NK_COPY_TO_DEVICE || !target->track_dirty) {
+        return node.regions;
+    }
+
+    // only the dirty parts of the regions
+    std::vector<VkBufferCopy> regions;
+    for (const auto& region : node.regions) {
+        for (const auto& range : target->dirty.at(frame)) {
+            const VkDeviceSize begin{std::max(region.srcOffset, range.offset)};
+            const VkDeviceSize end{std::min(region.srcOffset + region.size, range.offset + range.size)};
+            if (begin < end) {
+                regions.push_back(VkBufferCopy{.srcOffset = begin, .dstOffset = begin, .size = end - begin});
+            }
+        }
+    }
+    return regions;
+}
+
+bool Instance::acquire_mapping(const Access& access, VkBufferMemoryBarrier2& acquire,
+    std::vector<PlannedBarrier>& carried)
+{
+    // staging buffers never leave the queue doing the copies
+    auto mapping{access.mapping};
+    if (access.host || mapping->unified()) {
+        return false;
+    }
+
+    const uint32_t queue_index{segments_.back().queue_index};
+    const uint32_t segment{static_cast<uint32_t>(segments_.size() - 1)};
+    const bool transfer_ownership{mapping->owner != VK_QUEUE_FAMILY_IGNORED && mapping->owner != queue_index};
+
+    if (transfer_ownership) {
+        // release at the end of the segment that used the buffers last, acquire here;
+        // the semaphore chain between the segments orders the two, the wait on the
+        // frame's fence a release by the previous submission
+        const PlannedBarrier release{
+            .access = &access,
+            .barrier = VkBufferMemoryBarrier2{
+                .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                .srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                .srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT,
+                .srcQueueFamilyIndex = mapping->owner,
+                .dstQueueFamilyIndex = queue_index,
+                .size = VK_WHOLE_SIZE,
+            },
+        };
+        if (mapping->owner_segment == UINT32_MAX) {
+            mapping->carried_to = queue_index;
+            carried.push_back(release);
+        } else {
+            segments_.at(mapping->owner_segment).releases.push_back(release);
+        }
+
+        acquire = VkBufferMemoryBarrier2{
+            .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+            .dstStageMask = access.stage,
+            .dstAccessMask = access.access,
+            .srcQueueFamilyIndex = mapping->owner,
+            .dstQueueFamilyIndex = queue_index,
+            .size = VK_WHOLE_SIZE,
+        };
+    }
+
+    mapping->owner = queue_index;
+    mapping->owner_segment = segment;
+    return transfer_ownership;
+}
+
+bool Instance::prepare_ownership(uint32_t frame)
+{
+    // in order: acquires of buffers released by an older plan, hand over to the
+    // last user of this plan, release to its first user
+    std::array<std::vector<std::pair<uint32_t, VkBufferMemoryBarrier2>>, 4> steps;
+    for (auto mapping : mem_mappings_) {
+        if (mapping->owner == VK_QUEUE_FAMILY_IGNORED) {
+            continue;
+        }
+        const auto& buffs{mapping->buffers(frame)};
+        // the first use of new buffers takes them implicitly
+        if ((buffs.owner == VK_QUEUE_FAMILY_IGNORED || buffs.owner == mapping->owner) &&
+            buffs.released_to == mapping->carried_to) {
+            continue;
+        }
+
+        auto transfer = [&](uint32_t src, uint32_t dst) {
+            return VkBufferMemoryBarrier2{
+                .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER_2,
+                .srcStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                .srcAccessMask = VK_ACCESS_2_MEMORY_WRITE_BIT,
+                .dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                .dstAccessMask = VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT,
+                .srcQueueFamilyIndex = src,
+                .dstQueueFamilyIndex = dst,
+                .buffer = buffs.device_buff,
+                .size = VK_WHOLE_SIZE,
+            };
+        };
+        uint32_t owner{buffs.owner};
+        if (buffs.released_to != VK_QUEUE_FAMILY_IGNORED) {
+            steps.at(0).emplace_back(buffs.released_to, transfer(owner, buffs.released_to));
+            owner = buffs.released_to;
+        }
+        if (owner != VK_QUEUE_FAMILY_IGNORED && owner != mapping->owner) {
+            steps.at(1).emplace_back(owner, transfer(owner, mapping->owner));
+            steps.at(2).emplace_back(mapping->owner, transfer(owner, mapping->owner));
+        }
+        if (mapping->carried_to != VK_QUEUE_FAMILY_IGNORED) {
+            steps.at(3).emplace_back(mapping->owner, transfer(mapping->owner, mapping->carried_to));
+        }
+    }
+
+    for (const auto& step : steps) {
+        for (auto queue_index : {queue_index_, transfer_queue_index_}) {
+            std::vector<VkBufferMemoryBarrier2> barriers;
+            for (const auto& [family, barrier] : step) {
+                if (family == queue_index) {
+                    barriers.push_back(barrier);
+                }
+            }
+            if (!barriers.empty() && !submit_barriers(queue_index, barriers)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool Instance::submit_barriers(uint32_t queue_index, const std::vector<VkBufferMemoryBarrier2>& barriers)
+{
+    const auto pool{queue_index == queue_index_ ? cmd_pool_ : transfer_cmd_pool_};
+    const auto queue{queue_index == queue_index_ ? queue_ : transfer_queue_};
+    VkCommandBufferAllocateInfo cmd_buf_alloc_info{
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = pool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+    };
+    VkCommandBuffer cmd_buf;
+    COV_CHECK_FALSE(vkAllocateCommandBuffers(device_, &cmd_buf_alloc_info, &cmd_buf))
+
+    VkCommandBufferBeginInfo cmd_begin_info{
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    VkDependencyInfo dependency_info{
+        .sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO,
+        .bufferMemoryBarrierCount = static_cast<uint32_t>(barriers.size()),
+        .pBufferMemoryBarriers = barriers.data(),
+    };
+    VkSubmitInfo submit_info{
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &cmd_buf,
+    };
+    VkResult result{vkBeginCommandBuffer(cmd_buf, &cmd_begin_info)};
+    if (result == VK_SUCCESS) {
+        vkCmdPipelineBarrier2(cmd_buf, &dependency_info);
+        result = vkEndCommandBuffer(cmd_buf);
+    }
+    if (result == VK_SUCCESS) {
+        result = vkQueueSubmit(queue, 1, &submit_info, VK_NULL_HANDLE);
+    }
+    // only after compiling, waiting is simpler than chaining semaphores
+    if (result == VK_SUCCESS) {
+        result = vkQueueWaitIdle(queue);
+    }
+    vkFreeCommandBuffers(device_, pool, 1, &cmd_buf);
+    COV_CHECK_FALSE(result)
+    return true;
+}
+
+VkDescriptorSetLayout Instance::get_set_layout(uint32_t binding_count)
+{
+    if (binding_count < set_layouts_.size() && set_layouts_.at(binding_count) != VK_NULL_HANDLE) {
+        return set_layouts_.at(binding_count);
+    }
+
+    std::vector<VkDescriptorSetLayoutBinding> set_layout_bindings(binding_count);
+    for (uint32_t i = 0; i < binding_count; ++i) {
+        set_layout_bindings.at(i) = VkDescriptorSetLayoutBinding{
+            .binding = i,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT
+        };
+    }
+
+    VkDescriptorSetLayoutCreateInfo layout_create_info{};
+    layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_create_info.bindingCount = binding_count;
+    layout_create_info.pBindings = set_layout_bindings.data();
+
+    VkDescriptorSetLayout layout{VK_NULL_HANDLE};
+    COV_CHECK_ASSERT(vkCreateDescriptorSetLayout(device_, &layout_create_info, nullptr, &layout))
+    if (binding_count >= set_layouts_.size()) {
+        set_layouts_.resize(binding_count + 1, VK_NULL_HANDLE);
+    }
+    set_layouts_.at(binding_count) = layout;
+    return layout;
+}
+
+VkDescriptorUpdateTemplate Instance::get_update_template(uint32_t binding_count)
+{
+    if (binding_count < update_templates_.size() && update_templates_.at(binding_count) != VK_NULL_HANDLE) {
+        return update_templates_.at(binding_count);
+    }
+
+    std::vector<VkDescriptorUpdateTemplateEntry> entries(binding_count);
+    for (uint32_t i = 0; i < binding_count; ++i) {
+        entries.at(i) = VkDescriptorUpdateTemplateEntry{
+            .dstBinding = i,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .offset = i * sizeof(VkDescriptorBufferInfo),
+            .stride = sizeof(VkDescriptorBufferInfo),
+        };
+    }
+
+    VkDescriptorUpdateTemplateCreateInfo template_create_info{};
+    template_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO;
+    template_create_info.descriptorUpdateEntryCount = binding_count;
+    template_create_info.pDescriptorUpdateEntries = entries.data();
+    template_create_info.templateType = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET;
+    template_create_info.descriptorSetLayout = get_set_layout(binding_count);
+
+    VkDescriptorUpdateTemplate update_template{VK_NULL_HANDLE};
+    COV_CHECK_ASSERT(vkCreateDescriptorUpdateTemplate(device_, &template_create_info, nullptr, &update_template))
+    if (binding_count >= update_templates_.size()) {
+        update_templates_.resize(binding_count + 1, VK_NULL_HANDLE);
+    }
+    update_templates_.at(binding_count) = update_template;
+    return update_template;
+}
+
+bool Instance::allocate_desc_sets(const std::vector<VkDescriptorSetLayout>& layouts, std::vector<VkDescriptorSet>& sets)
+{
+    sets.resize(layouts.size());
+    if (layouts.empty()) {
+        return true;
+    }
+
+    VkDescriptorSetAllocateInfo desc_alloc_info{};
+    desc_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    desc_alloc_info.descriptorSetCount = static_cast<uint32_t>(layouts.size());
+    desc_alloc_info.pSetLayouts = layouts.data();
+    if (!desc_pools_.empty()) {
+        desc_alloc_info.descriptorPool = desc_pools_.back();
+        const auto result{vkAllocateDescriptorSets(device_, &desc_alloc_info, sets.data())};
+        if (result == VK_SUCCESS) {
+            count(MC_DESCRIPTOR_SETS, sets.size());
+            return true;
+        }
+        if (result != VK_ERROR_OUT_OF_POOL_MEMORY && result != VK_ERROR_FRAGMENTED_POOL) {
+            COV_CHECK_FALSE(result)
+        }
+    }
+
+    // the current pool is exhausted, sets are never freed individually
+    uint32_t descriptor_count{0};
+    for (auto layout : layouts) {
+        // a cached layout's binding count is its index
+        descriptor_count += static_cast<uint32_t>(
+            std::find(set_layouts_.begin(), set_layouts_.end(), layout) - set_layouts_.begin());
+    }
+    const uint32_t max_sets{std::max<uint32_t>(COV_DESCRIPTOR_POOL_SIZE, layouts.size())};
+    std::vector<VkDescriptorPoolSize> pool_sizes{
+        VkDescriptorPoolSize{
+            .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = std::max(max_sets * 4, descriptor_count)
+        }
+    };
+    VkDescriptorPoolCreateInfo pool_create_info{};
+    pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_create_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
+    pool_create_info.pPoolSizes = pool_sizes.data();
+    pool_create_info.maxSets = max_sets;
+    auto& pool{desc_pools_.emplace_back()};
+    COV_CHECK_FALSE(vkCreateDescriptorPool(device_, &pool_create_info, nullptr, &pool))
+
+    desc_alloc_info.descriptorPool = pool;
+    COV_CHECK_FALSE(vkAllocateDescriptorSets(device_, &desc_alloc_info, sets.data()))
+    count(MC_DESCRIPTOR_SETS, sets.size());
+    return true;
+}
+
+bool Instance::set_pipeline_cache_path(std::string_view path)
+{
+    pipeline_cache_path_ = path;
+
+    std::ifstream ifs(pipeline_cache_path_, std::ios::in | std::ios::binary);
+    if (!ifs.is_open()) {
+        return false;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    if (!pipeline_cache_compatible(data)) {
+        // written by another device or driver, it is replaced on save
+        return false;
+    }
+
+    VkPipelineCache loaded_cache;
+    VkPipelineCacheCreateInfo pipeline_cache_create_info{};
+    pipeline_cache_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    pipeline_cache_create_info.initialDataSize = data.size();
+    pipeline_cache_create_info.pInitialData = data.data();
+    COV_CHECK_FALSE(vkCreatePipelineCache(device_, &pipeline_cache_create_info, nullptr, &loaded_cache))
+
+    // keep what steps built so far
+    COV_CHECK_FALSE(vkMergePipelineCaches(device_, loaded_cache, 1, &pipeline_cache_))
+    vkDestroyPipelineCache(device_, pipeline_cache_, nullptr);
+    pipeline_cache_ = loaded_cache;
+    return true;
+}
+
+bool Instance::pipeline_cache_compatible(const std::vector<char>& data) const
+{
+    VkPipelineCacheHeaderVersionOne header;
+    if (data.size() < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(phy_device_, &properties);
+    return header.headerSize >= sizeof(header) &&
+        header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+        header.vendorID == properties.vendorID &&
+        header.deviceID == properties.deviceID &&
+        memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+bool Instance::save_pipeline_cache()
+{
+    assert(!pipeline_cache_path_.empty() && "No pipeline cache path set");
+
+    size_t size{0};
+    COV_CHECK_FALSE(vkGetPipelineCacheData(device_, pipeline_cache_, &size, nullptr))
+    std::vector<char> data(size);
+    COV_CHECK_FALSE(vkGetPipelineCacheData(device_, pipeline_cache_, &size, data.data()))
+
+    // write aside and rename, readers never see a partially written cache
+    const std::string tmp_path{pipeline_cache_path_ + ".tmp"};
+    {
+        std::ofstream ofs(tmp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!ofs.is_open()) {
+            return false;
+        }
+        ofs.write(data.data(), size);
+        ofs.flush();
+        if (!ofs.good()) {
+            std::remove(tmp_path.c_str());
+            return false;
+        }
+    }
+    return std::rename(tmp_path.c_str(), pipeline_cache_path_.c_str()) == 0;
+}
+
+VkShaderModule Instance::get_shader_module(const void* code, size_t size)
+{
+    const uint64_t hash{fnv1a(code, size)};
+    for (const auto& entry : shader_modules_) {
+        if (entry.hash == hash && entry.code.size() == size && memcmp(entry.code.data(), code, size) == 0) {
+            return entry.module;
+        }
+    }
+
+    VkShaderModule module{VK_NULL_HANDLE};
+    VkShaderModuleCreateInfo create_info{};
+    create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    create_info.codeSize = size;
+    create_info.pCode = reinterpret_cast<const uint32_t*>(code);
+    COV_CHECK_ASSERT(vkCreateShaderModule(device_, &create_info, nullptr, &module))
+
+    const auto bytes{static_cast<const char*>(code)};
+    shader_modules_.push_back(ShaderModuleEntry{
+        .hash = hash,
+        .code = std::vector<char>(bytes, bytes + size),
+        .module = module,
+    });
+    return module;
+}
+
+VkShaderModule Instance::get_shader_module(std::string_view path)
+{
+    // files are read once per instance
+    for (const auto& [shader_path, module] : shader_paths_) {
+        if (shader_path == path) {
+            return module;
+        }
+    }
+
+    std::ifstream ifs(std::string(path), std::ios::in | std::ios::binary);
+    if (!ifs.is_open()) {
+        return VK_NULL_HANDLE;
+    }
+    std::vector<char> code((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    const auto module{get_shader_module(code.data(), code.size())};
+    shader_paths_.emplace_back(path, module);
+    return module;
+}
+
+VkPipelineLayout Instance::get_pipeline_layout(const std::vector<VkDescriptorSetLayout>& set_layouts,
+    uint32_t push_constant_size)
+{
+    for (const auto& entry : pipeline_layouts_) {
+        if (entry.set_layouts == set_layouts && entry.push_constant_size == push_constant_size) {
+            return entry.layout;
+        }
+    }
+
+    VkPipelineLayoutCreateInfo pipeline_create_info{};
+    pipeline_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_create_info.setLayoutCount = set_layouts.size();
+    pipeline_create_info.pSetLayouts = set_layouts.data();
+    VkPushConstantRange push_constant_range{
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = push_constant_size,
+    };
+    if (push_constant_size > 0) {
+        pipeline_create_info.pushConstantRangeCount = 1;
+        pipeline_create_info.pPushConstantRanges = &push_constant_range;
+    }
+
+    VkPipelineLayout layout{VK_NULL_HANDLE};
+    COV_CHECK_ASSERT(vkCreatePipelineLayout(device_, &pipeline_create_info, nullptr, &layout))
+    pipeline_layouts_.push_back(PipelineLayoutEntry{
+        .set_layouts = set_layouts,
+        .push_constant_size = push_constant_size,
+        .layout = layout,
+    });
+    return layout;
+}
+
+uint32_t Instance::get_pipeline(VkShaderModule module, VkPipelineLayout layout,
+    const std::vector<VkSpecializationMapEntry>& spec_entries, const std::vector<uint8_t>& spec_data)
+{
+    // the same constants set in another order give the same pipeline
+    std::vector<VkSpecializationMapEntry> sorted_entries{spec_entries};
+    std::sort(sorted_entries.begin(), sorted_entries.end(),
+        [](const VkSpecializationMapEntry& a, const VkSpecializationMapEntry& b) { return a.constantID < b.constantID; });
+    std::vector<uint8_t> spec_key;
+    for (const auto& entry : sorted_entries) {
+        const uint32_t header[2]{entry.constantID, static_cast<uint32_t>(entry.size)};
+        spec_key.insert(spec_key.end(), reinterpret_cast<const uint8_t*>(header), reinterpret_cast<const uint8_t*>(header + 2));
+        spec_key.insert(spec_key.end(), spec_data.begin() + entry.offset, spec_data.begin() + entry.offset + entry.size);
+    }
+
+    uint64_t hash{fnv1a(&module, sizeof(module))};
+    hash = fnv1a(&layout, sizeof(layout), hash);
+    hash = fnv1a(spec_key.data(), spec_key.size(), hash);
+    for (uint32_t i = 0; i < pipelines_.size(); ++i) {
+        const auto& entry{pipelines_.at(i)};
+        if (entry.hash == hash && entry.module == module && entry.layout == layout && entry.spec_key == spec_key) {
+            return i;
+        }
+    }
+
+    pipelines_.push_back(PipelineEntry{
+        .hash = hash,
+        .module = module,
+        .layout = layout,
+        .spec_key = std::move(spec_key),
+        .spec_entries = spec_entries,
+        .spec_data = spec_data,
+        .pipeline = VK_NULL_HANDLE,
+    });
+    // cmd_buf_status_ was reset by the node of the step, compile() creates it
+    return static_cast<uint32_t>(pipelines_.size() - 1);
+}
+
+bool Instance::build_pipelines()
+{
+    TraceSpan span{this, "create_pipelines"};
+    std::vector<uint32_t> pending;
+    for (uint32_t i = 0; i < pipelines_.size(); ++i) {
+        if (pipelines_.at(i).pipeline == VK_NULL_HANDLE) {
+            pending.push_back(i);
+        }
+    }
+    if (pending.empty()) {
+        return true;
+    }
+
+    // every worker creates a contiguous share with a single call, the
+    // pipeline cache is internally synchronized
+    const uint32_t num_workers{std::min<uint32_t>(compile_threads_, pending.size())};
+    const size_t share{(pending.size() + num_workers - 1) / num_workers};
+    std::vector<VkResult> results(num_workers, VK_SUCCESS);
+    auto worker = [&](uint32_t w) {
+        const size_t first{w * share};
+        const size_t last{std::min(first + share, pending.size())};
+        if (first >= last) {
+            return;
+        }
+
+        std::vector<VkSpecializationInfo> spec_infos(last - first);
+        std::vector<VkComputePipelineCreateInfo> create_infos(last - first);
+        std::vector<VkPipeline> pipelines(last - first, VK_NULL_HANDLE);
+        for (size_t i = first; i < last; ++i) {
+            const auto& entry{pipelines_.at(pending.at(i))};
+            auto& spec_info{spec_infos.at(i - first)};
+            spec_info = VkSpecializationInfo{
+                .mapEntryCount = static_cast<uint32_t>(entry.spec_entries.size()),
+                .pMapEntries = entry.spec_entries.data(),
+                .dataSize = entry.spec_data.size(),
+                .pData = entry.spec_data.data(),
+            };
+
+            VkPipelineShaderStageCreateInfo shader_stage_create_info{};
+            shader_stage_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+            shader_stage_create_info.module = entry.module;
+            shader_stage_create_info.pSpecializationInfo = entry.spec_entries.empty() ? VK_NULL_HANDLE : &spec_info;
+            shader_stage_create_info.pName = "main";
+            shader_stage_create_info.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+
+            auto& comp_pipeline_create_info{create_infos.at(i - first)};
+            comp_pipeline_create_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+            comp_pipeline_create_info.stage = shader_stage_create_info;
+            comp_pipeline_create_info.layout = entry.layout;
+            comp_pipeline_create_info.flags = 0;
+        }
+
+        results.at(w) = vkCreateComputePipelines(device_, pipeline_cache_,
+            static_cast<uint32_t>(create_infos.size()), create_infos.data(), nullptr, pipelines.data());
+        // failed creations are left VK_NULL_HANDLE
+        for (size_t i = first; i < last; ++i) {
+            pipelines_.at(pending.at(i)).pipeline = pipelines.at(i - first);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (uint32_t w = 1; w < num_workers; ++w) {
+        workers.emplace_back(worker, w);
+    }
+    worker(0);
+    for (auto& t : workers) {
+        t.join();
+    }
+
+    for (auto result : results) {
+        COV_CHECK_FALSE(result)
+    }
+    count(MC_PIPELINES, pending.size());
+    return true;
+}
+
+void Instance::set_compile_threads(uint32_t count)
+{
+    assert(count > 0 && "Bad thread count");
+    compile_threads_ = count;
+}
+
+Submission Instance::submit()
+{
+    TraceSpan span{this, "submit"};
+    // serials start at 1, 0 marks a submission that never happened
+    if (!compile()) {
+        return Submission{this, 0, frame_};
+    }
+    // a frame's command buffer may not be pending twice
+    const uint32_t frame{begin_frame()};
+    // bindings changed since this frame was recorded, or only push constants or
+    // dirty ranges of some segments, the compiled plan is replayed
+    if (recorded_versions_.at(frame) != record_version_) {
+        if (!record_frame(frame)) {
+            return Submission{this, 0, frame};
+        }
+        recorded_versions_.at(frame) = record_version_;
+    } else if (!record_patches(frame)) {
+        return Submission{this, 0, frame};
+    }
+    if (has_transfer_queue() && !prepare_ownership(frame)) {
+        return Submission{this, 0, frame};
+    }
+    if (!query_pools_.empty()) {
+        vkResetQueryPool(device_, query_pools_.at(frame), 0, query_count_);
+    }
+
+    const auto fence{acquire_fence()};
+    // nothing may wait on a fence that never signals, the segments submitted
+    // before the failed one still run and signal their semaphores
+    auto fail = [&](VkResult result, size_t segment) {
+        std::cerr << "Vulkan Failed with error: " << stringify(result) << "\n";
+        if (segment > 0) {
+            const VkPipelineStageFlags wait_stage_mask{VK_PIPELINE_STAGE_ALL_COMMANDS_BIT};
+            VkSubmitInfo submit_info{
+                .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+                .waitSemaphoreCount = 1,
+                .pWaitSemaphores = &segments_.at(segment - 1).semaphores.at(frame),
+                .pWaitDstStageMask = &wait_stage_mask,
+            };
+            vkQueueSubmit(segments_.at(segment).queue, 1, &submit_info, VK_NULL_HANDLE);
+        }
+        vkDeviceWaitIdle(device_);
+        fence_pool_.push_back(fence);
+        return Submission{this, 0, frame};
+    };
+    if (segments_.empty()) {
+        VkSubmitInfo submit_info{.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO};
+        const VkResult result{vkQueueSubmit(queue_, 1, &submit_info, fence)};
+        if (result != VK_SUCCESS) {
+            return fail(result, 0);
+        }
+    }
+
+    // segments are chained, so the fence on the last one covers them all
+    const VkPipelineStageFlags wait_stage_mask{VK_PIPELINE_STAGE_ALL_COMMANDS_BIT};
+    for (size_t i = 0; i < segments_.size(); ++i) {
+        const auto& segment{segments_.at(i)};
+        const bool last{i + 1 == segments_.size()};
+
+        VkSubmitInfo submit_info{};
+        submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        submit_info.commandBufferCount = 1;
+        submit_info.pCommandBuffers = &segment.cmd_bufs.at(frame);
+        if (i > 0) {
+            submit_info.waitSemaphoreCount = 1;
+            submit_info.pWaitSemaphores = &segments_.at(i - 1).semaphores.at(frame);
+            submit_info.pWaitDstStageMask = &wait_stage_mask;
+        }
+        if (!last) {
+            submit_info.signalSemaphoreCount = 1;
+            submit_info.pSignalSemaphores = &segment.semaphores.at(frame);
+        }
+        const VkResult result{vkQueueSubmit(segment.queue, 1, &submit_info, last ? fence : VK_NULL_HANDLE)};
+        if (result != VK_SUCCESS) {
+            return fail(result, i);
+        }
+    }
+    // the recorded copies consumed the dirty ranges, the segments of this frame holding them are stale
+    for (auto mapping : mem_mappings_) {
+        if (mapping->track_dirty && !mapping->dirty.at(frame).empty()) {
+            mapping->dirty.at(frame).clear();
+            mapping->dirty_versions.at(frame) = ++patch_version_;
+        }
+    }
+    if (has_transfer_queue()) {
+        for (auto mapping : mem_mappings_) {
+            if (mapping->owner != VK_QUEUE_FAMILY_IGNORED) {
+                auto& buffs{mapping->resolve()->frames.at(frame)};
+                buffs.owner = mapping->owner;
+                buffs.released_to = mapping->carried_to;
+            }
+        }
+    }
+
+    InFlight in_flight{
+        .serial = ++last_serial_,
+        .fence = fence,
+        .frame = frame,
+        .host_ns = tracing_ ? host_time_ns() : 0,
+        .device_ticks = UINT64_MAX,
+    };
+    if (tracing_ && get_calibrated_timestamps_ != nullptr) {
+        const std::array<VkCalibratedTimestampInfoEXT, 2> infos{
+            VkCalibratedTimestampInfoEXT{.sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT, .timeDomain = VK_TIME_DOMAIN_DEVICE_EXT},
+            VkCalibratedTimestampInfoEXT{.sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT, .timeDomain = VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT},
+        };
+        std::array<uint64_t, 2> timestamps;
+        uint64_t max_deviation;
+        if (get_calibrated_timestamps_(device_, 2, infos.data(), timestamps.data(), &max_deviation) == VK_SUCCESS) {
+            in_flight.device_ticks = timestamps.at(0);
+            in_flight.host_ns = timestamps.at(1);
+        }
+    }
+    in_flight_.push_back(in_flight);
+    const auto& work{frame_work_.at(frame)};
+    count(MC_SUBMISSIONS, 1);
+    count(MC_BYTES_UPLOADED, work.bytes_uploaded);
+    count(MC_BYTES_DOWNLOADED, work.bytes_downloaded);
+    count(MC_DISPATCHES, work.dispatches);
+    count(MC_WORKGROUPS, work.workgroups);
+    frame_serials_.at(frame) = last_serial_;
+    frame_ = (frame + 1) % frames_in_flight_;
+    return Submission{this, last_serial_, frame};
+}
+
+bool Instance::execute()
+{
+    // an invalid submission fails the wait
+    return submit().wait();
+}
+
+bool Instance::stream(const std::vector<StreamArray>& arrays, const std::function<void(uint64_t)>& prepare)
+{
+    uint64_t chunk_count{0};
+    for (const auto& array : arrays) {
+        assert(array.mapping != nullptr && (array.src == nullptr) != (array.dst == nullptr) &&
+            "A stream array is either uploaded or downloaded");
+        chunk_count = std::max<uint64_t>(chunk_count, (array.size + array.mapping->size - 1) / array.mapping->size);
+
+        const bool upload{array.src != nullptr};
+        const auto kind{upload ? Node::NK_COPY_TO_DEVICE : Node::NK_HOST_READ};
+        if (std::any_of(nodes_.begin(), nodes_.end(), [&](const Node& node) {
+                return node.kind == kind && node.mapping == array.mapping;
+            })) {
+            continue;
+        }
+        const auto first{static_cast<std::ptrdiff_t>(nodes_.size())};
+        if (upload) {
+            add_transfer_step()->to_device(array.mapping);
+            std::rotate(nodes_.begin(), nodes_.begin() + first, nodes_.end());
+        } else {
+            add_transfer_step()->from_device(array.mapping);
+        }
+    }
+
+    auto chunk_bytes = [](const StreamArray& array, uint64_t chunk) -> size_t {
+        const uint64_t offset{chunk * array.mapping->size};
+        return offset < array.size ? std::min<size_t>(array.mapping->size, array.size - offset) : 0;
+    };
+    auto drain = [&](uint64_t chunk, uint32_t frame) {
+        for (const auto& array : arrays) {
+            const size_t size{chunk_bytes(array, chunk)};
+            if (array.dst != nullptr && size > 0 &&
+                !array.mapping->copy_to(static_cast<uint8_t*>(array.dst) + chunk * array.mapping->size, size, 0, frame)) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    // chunk occupying each frame, UINT64_MAX when the frame is free
+    std::vector<uint64_t> pending(frames_in_flight_, UINT64_MAX);
+    for (uint64_t chunk = 0; chunk < chunk_count; ++chunk) {
+        const uint32_t frame{begin_frame()};
+        if (pending.at(frame) != UINT64_MAX && !drain(pending.at(frame), frame)) {
+            return false;
+        }
+        for (const auto& array : arrays) {
+            const size_t size{chunk_bytes(array, chunk)};
+            if (array.src != nullptr && size > 0 &&
+                !array.mapping->copy_from(static_cast<const uint8_t*>(array.src) + chunk * array.mapping->size,
+                    size, 0, frame)) {
+                return false;
+            }
+        }
+        if (prepare) {
+            prepare(chunk);
+        }
+        if (!submit().valid()) {
+            return false;
+        }
+        pending.at(frame) = chunk;
+    }
+
+    if (!wait_serial(last_serial_, UINT64_MAX)) {
+        return false;
+    }
+    for (uint32_t f = 0; f < frames_in_flight_; ++f) {
+        if (pending.at(f) != UINT64_MAX && !drain(pending.at(f), f)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+VkFence Instance::acquire_fence()
+{
+    if (!fence_pool_.empty()) {
+        const auto fence{fence_pool_.back()};
+        fence_pool_.pop_back();
+        return fence;
+    }
+
+    VkFence fence;
+    VkFenceCreateInfo fence_create_info{};
+    fence_create_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    COV_CHECK_ASSERT(vkCreateFence(device_, &fence_create_info, nullptr, &fence))
+    return fence;
+}
+
+bool Instance::wait_serial(uint64_t serial, uint64_t timeout_ns)
+{
+    // retire in submission order, recycling each fence once it has signaled
+    while (!in_flight_.empty() && in_flight_.front().serial <= serial) {
+        auto fence{in_flight_.front().fence};
+        VkResult result;
+        {
+            TraceSpan span{timeout_ns != 0 ? this : nullptr, "wait"};
+            const uint64_t begin_ns{host_time_ns()};
+            result = vkWaitForFences(device_, 1, &fence, VK_TRUE, timeout_ns);
+            count(MC_WAIT_NS, host_time_ns() - begin_ns);
+        }
+        if (result == VK_TIMEOUT) {
+            return false;
+        }
+        COV_CHECK_FALSE(result)
+
+        if (tracing_ && !query_pools_.empty()) {
+            trace_device(in_flight_.front());
+        }
+        vkResetFences(device_, 1, &fence);
+        fence_pool_.push_back(fence);
+        in_flight_.pop_front();
+    }
+    return true;
+}
+
+bool Submission::wait()
+{
+    return valid() && instance->wait_serial(serial, UINT64_MAX);
+}
+
+bool Submission::wait_for(uint64_t timeout_ns)
+{
+    return valid() && instance->wait_serial(serial, timeout_ns);
+}
+
+bool Submission::ready()
+{
+    return valid() && instance->wait_serial(serial, 0);
+}
+
+bool Instance::init_command_pool(VkDevice device, uint32_t queue_index, VkCommandPool& cmd_pool)
+{
+    VkCommandPoolCreateInfo create_info{};
+    create_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    create_info.queueFamilyIndex = queue_index;
+    create_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+
+    if (vkCreateCommandPool(device, &create_info, nullptr, &cmd_pool) != VK_SUCCESS) {
+        return false;
+    }
+    return true;
+}
+
+TransferStep* Instance::add_transfer_step()
+{
+    transfer_steps_.push_back(new TransferStep{this});
+    auto step{transfer_steps_.back()};
+    return step;
+}
+
+ComputeStep* Instance::add_compute_step()
+{
+    comp_steps_.push_back(new ComputeStep{this});
+    auto step{comp_steps_.back()};
+    return step;
+}
+
+void MemMapping::destroy()
+{
+    for (auto& frame : frames) {
+        if (frame.host_buff != frame.device_buff) {
+            vkDestroyBuffer(instance->device_, frame.host_buff, nullptr);
+            instance->allocator_.free(frame.host_alloc);
+        }
+        vkDestroyBuffer(instance->device_, frame.device_buff, nullptr);
+        instance->allocator_.free(frame.device_alloc);
+    }
+    frames.clear();
+}
+
+bool MemMapping::unified() const
+{
+    return instance->unified_memory_;
+}
+
+MemMapping* MemMapping::resolve() const
+{
+    if (!name.empty()) {
+        assert(bound != nullptr && "Argument used before bind()");
+        return bound;
+    }
+    return const_cast<MemMapping*>(this);
+}
+
+MemMapping* MemMapping::track_dirty_ranges(bool enable)
+{
+    assert(name.empty() && "Track dirty ranges on the bound mappings");
+    track_dirty = enable;
+    dirty.assign(frames.size(), {});
+    // the copies recorded so far upload the whole range
+    ++instance->record_version_;
+    return this;
+}
+
+void MemMapping::mark_dirty(size_t offset, size_t size, uint32_t frame)
+{
+    assert(offset + size <= this->size && "Dirty range out of the buffer");
+    auto target{resolve()};
+    // nothing is copied on unified memory
+    if (!target->track_dirty || size == 0 || unified()) {
+        return;
+    }
+
+    // insert sorted and coalesce overlapping or adjacent ranges
+    auto& ranges{target->dirty.at(frame)};
+    auto it{ranges.begin()};
+    while (it != ranges.end() && it->offset + it->size < offset) {
+        ++it;
+    }
+    VkDeviceSize begin{offset};
+    VkDeviceSize end{offset + size};
+    auto last{it};
+    while (last != ranges.end() && last->offset <= end) {
+        begin = std::min(begin, last->offset);
+        end = std::max(end, last->offset + last->size);
+        ++last;
+    }
+    it = ranges.erase(it, last);
+    ranges.insert(it, BufferRange{.offset = begin, .size = end - begin});
+    // the copies of this frame change, only the segments holding them are recorded again
+    target->dirty_versions.at(frame) = ++instance->patch_version_;
+}
+
+uint32_t MemMapping::current_frame() const
+{
+    return instance->frame_;
+}
+
+uint32_t MemMapping::submitted_frame() const
+{
+    return (instance->frame_ + instance->frames_in_flight_ - 1) % instance->frames_in_flight_;
+}
+
+MemMapping::MemMapping(const MemMapping& other)
+{
+    instance = other.instance;
+    frames = other.frames;
+    size = other.size;
+    name = other.name;
+    bound = other.bound;
+    track_dirty = other.track_dirty;
+    dirty = other.dirty;
+    dirty_versions = other.dirty_versions;
+}
+
+MemMapping::MemMapping(MemMapping&& other)
+{
+    instance = other.instance;
+    frames = std::move(other.frames);
+    size = other.size;
+    name = std::move(other.name);
+    bound = other.bound;
+    track_dirty = other.track_dirty;
+    dirty = std::move(other.dirty);
+    dirty_versions = std::move(other.dirty_versions);
+
+    other.instance = nullptr;
+    other.frames.clear();
+    other.size = 0;
+}
+
+MemMapping& MemMapping::operator=(const MemMapping& other)
+{
+    instance = other.instance;
+    frames = other.frames;
+    size = other.size;
+    name = other.name;
+    bound = other.bound;
+    track_dirty = other.track_dirty;
+    dirty = other.dirty;
+    dirty_versions = other.dirty_versions;
+    return *this;
+}
+
+MemMapping& MemMapping::operator=(MemMapping&& other)
+{
+    if (this == &other) {
+        return *this;
+    }
+
+    instance = other.instance;
+    frames = std::move(other.frames);
+    size = other.size;
+    name = std::move(other.name);
+    bound = other.bound;
+    track_dirty = other.track_dirty;
+    dirty = std::move(other.dirty);
+    dirty_versions = std::move(other.dirty_versions);
+
+    other.instance = nullptr;
+    other.frames.clear();
+    other.size = 0;
+    return *this;
+}
+
+bool MemMapping::copy_from(const void* ptr, size_t size)
+{
+    return copy_from(ptr, size, current_frame());
+}
+
+bool MemMapping::copy_from(const void* ptr, size_t size, uint32_t frame)
+{
+    return copy_from(ptr, size, 0, frame);
+}
+
+bool MemMapping::copy_from(const void* ptr, size_t size, size_t offset, uint32_t frame)
+{
+    assert(ptr != nullptr && "Invalid pointer");
+    assert(size > 0 && "Invalid buffer size");
+    assert(offset + size <= this->size && "Invalid buffer size greate than pre-allocated buffer size");
+
+    TraceSpan span{instance, "copy_from", size};
+    memcpy(host_view<std::byte>(frame).data() + offset, ptr, size);
+    instance->count(Instance::MC_BYTES_COPIED_IN, size);
+    mark_dirty(offset, size, frame);
+    return true;
+}
+
+bool MemMapping::copy_to(void* ptr, size_t size)
+{
+    return copy_to(ptr, size, submitted_frame());
+}
+
+bool MemMapping::copy_to(void* ptr, size_t size, uint32_t frame)
+{
+    return copy_to(ptr, size, 0, frame);
+}
+
+bool MemMapping::copy_to(void* ptr, size_t size, size_t offset, uint32_t frame)
+{
+    assert(ptr != nullptr && "Invalid pointer");
+    assert(size > 0 && "Invalid buffer size");
+    assert(offset + size <= this->size && "Invalid buffer size greate than pre-allocated buffer size");
+
+    TraceSpan span{instance, "copy_to", size};
+    memcpy(ptr, host_view<std::byte>(frame).data() + offset, size);
+    instance->count(Instance::MC_BYTES_COPIED_OUT, size);
+    return true;
+}
+
+bool MemMapping::load_file(std::string_view path, size_t file_offset, size_t size)
+{
+    TraceSpan span{instance, "load_file"};
+    const uint32_t frame{current_frame()};
+    auto dst{host_view<uint8_t>(frame).data()};
+    const std::string file_path(path);
+
+#if COV_HAS_MMAP
+    const int fd{open(file_path.c_str(), O_RDONLY)};
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || file_offset > static_cast<size_t>(st.st_size)) {
+        close(fd);
+        return false;
+    }
+    if (size == 0) {
+        size = std::min<size_t>(this->size, st.st_size - file_offset);
+    }
+    // a short file is no programming error, and reading past its end raises SIGBUS
+    if (size > this->size || file_offset + size > static_cast<size_t>(st.st_size)) {
+        close(fd);
+        return false;
+    }
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+
+    // mappings start on a page boundary
+    const size_t page{static_cast<size_t>(sysconf(_SC_PAGESIZE))};
+    const size_t map_offset{file_offset / page * page};
+    const size_t map_size{size + file_offset - map_offset};
+    void* map{mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(map_offset))};
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    madvise(map, map_size, MADV_SEQUENTIAL);
+
+    // copy in chunks, dropping the pages already copied so the file never
+    // stays resident next to the staging memory
+    const auto src{static_cast<const uint8_t*>(map) + (file_offset - map_offset)};
+    for (size_t done = 0; done < size; done += COV_FILE_CHUNK_SIZE) {
+        const size_t chunk{std::min<size_t>(COV_FILE_CHUNK_SIZE, size - done)};
+        memcpy(dst + done, src + done, chunk);
+        const size_t release_end{(file_offset - map_offset + done + chunk) / page * page};
+        madvise(map, release_end, MADV_DONTNEED);
+    }
+    munmap(map, map_size);
+#else // COV_HAS_MMAP
+    std::ifstream ifs(file_path, std::ios::in | std::ios::binary | std::ios::ate);
+    if (!ifs.is_open() || file_offset > static_cast<size_t>(ifs.tellg())) {
+        return false;
+    }
+    if (size == 0) {
+        size = std::min<size_t>(this->size, static_cast<size_t>(ifs.tellg()) - file_offset);
+    }
+    if (size > this->size || file_offset + size > static_cast<size_t>(ifs.tellg())) {
+        return false;
+    }
+    ifs.seekg(file_offset);
+    if (!ifs.read(reinterpret_cast<char*>(dst), size)) {
+        return false;
+    }
+#endif // COV_HAS_MMAP
+
+    span.set_bytes(size);
+    instance->count(Instance::MC_BYTES_COPIED_IN, size);
+    mark_dirty(0, size, frame);
+    return true;
+}
+
+bool MemMapping::store_file(std::string_view path, size_t file_offset, size_t size)
+{
+    TraceSpan span{instance, "store_file"};
+    const auto src{host_view<uint8_t>(submitted_frame()).data()};
+    const std::string file_path(path);
+    if (size == 0) {
+        size = this->size;
+    }
+    if (size > this->size) {
+        return false;
+    }
+    span.set_bytes(size);
+    instance->count(Instance::MC_BYTES_COPIED_OUT, size);
+
+#if COV_HAS_MMAP
+    // written from the staging memory, the rest of the file is kept
+    const int fd{open(file_path.c_str(), O_WRONLY | O_CREAT, 0644)};
+    if (fd < 0) {
+        return false;
+    }
+    for (size_t done = 0; done < size;) {
+        const size_t chunk{std::min<size_t>(COV_FILE_CHUNK_SIZE, size - done)};
+        const auto written{pwrite(fd, src + done, chunk, static_cast<off_t>(file_offset + done))};
+        if (written <= 0) {
+            close(fd);
+            return false;
+        }
+        done += static_cast<size_t>(written);
+    }
+    return close(fd) == 0;
+#else // COV_HAS_MMAP
+    std::fstream fs(file_path, std::ios::in | std::ios::out | std::ios::binary);
+    if (!fs.is_open()) {
+        fs.open(file_path, std::ios::out | std::ios::binary);
+    }
+    if (!fs.is_open()) {
+        return false;
+    }
+    fs.seekp(file_offset);
+    return static_cast<bool>(fs.write(reinterpret_cast<const char*>(src), size));
+#endif // COV_HAS_MMAP
+}
+
+TransferStep* TransferStep::to_device(MemMapping* mapping)
+{
+    assert(mapping != nullptr && "Invalid memory mapping");
+    return to_device(mapping, {BufferRange{.offset = 0, .size = mapping->size}});
+}
+
+TransferStep* TransferStep::to_device(MemMapping* mapping, VkDeviceSize offset, VkDeviceSize size)
+{
+    return to_device(mapping, {BufferRange{.offset = offset, .size = size}});
+}
+
+TransferStep* TransferStep::to_device(MemMapping* mapping, const std::vector<BufferRange>& ranges)
+{
+    assert(mapping != nullptr && "Invalid memory mapping");
+
+    if (mapping->unified()) {
+        // host writes are made visible to the device by the queue submission
+        return this;
+    }
+
+    Instance::Node node{
+        .kind = Instance::Node::NK_COPY_TO_DEVICE,
+        .transfer = instance->has_transfer_queue(),
+        .mapping = mapping,
+        .transfer_step = this,
+    };
+    for (const auto& range : ranges) {
+        assert(range.size > 0 && range.offset + range.size <= mapping->size && "Transfer range out of the buffer");
+        node.regions.push_back(VkBufferCopy{.srcOffset = range.offset, .dstOffset = range.offset, .size = range.size});
+        node.accesses.push_back(Instance::Access{
+            .mapping = mapping, .host = true, .offset = range.offset, .size = range.size,
+            .stage = VK_PIPELINE_STAGE_2_COPY_BIT, .access = VK_ACCESS_2_TRANSFER_READ_BIT, .write = false,
+        });
+        node.accesses.push_back(Instance::Access{
+            .mapping = mapping, .host = false, .offset = range.offset, .size = range.size,
+            .stage = VK_PIPELINE_STAGE_2_COPY_BIT, .access = VK_ACCESS_2_TRANSFER_WRITE_BIT, .write = true,
+        });
+    }
+    instance->add_node(std::move(node));
+    return this;
+}
+
+TransferStep* TransferStep::from_device(MemMapping* mapping)
+{
+    assert(mapping != nullptr && "Invalid memory mapping");
+    return from_device(mapping, {BufferRange{.offset = 0, .size = mapping->size}});
+}
+
+TransferStep* TransferStep::from_device(MemMapping* mapping, VkDeviceSize offset, VkDeviceSize size)
+{
+    return from_device(mapping, {BufferRange{.offset = offset, .size = size}});
+}
+
+TransferStep* TransferStep::from_device(MemMapping* mapping, const std::vector<BufferRange>& ranges)
+{
+    assert(mapping != nullptr && "Invalid memory mapping");
+
+    const bool transfer{!mapping->unified() && instance->has_transfer_queue()};
+    Instance::Node copy{
+        .kind = Instance::Node::NK_COPY_FROM_DEVICE,
+        .transfer = transfer,
+        .mapping = mapping,
+        .transfer_step = this,
+    };
+    // on unified memory this alone makes the device writes visible to the mapped memory
+    Instance::Node host_read{
+        .kind = Instance::Node::NK_HOST_READ,
+        .transfer = transfer,
+        .mapping = mapping,
+        .transfer_step = this,
+    };
+    for (const auto& range : ranges) {
+        assert(range.size > 0 && range.offset + range.size <= mapping->size && "Transfer range out of the buffer");
+        copy.regions.push_back(VkBufferCopy{.srcOffset = range.offset, .dstOffset = range.offset, .size = range.size});
+        copy.accesses.push_back(Instance::Access{
+            .mapping = mapping, .host = false, .offset = range.offset, .size = range.size,
+            .stage = VK_PIPELINE_STAGE_2_COPY_BIT, .access = VK_ACCESS_2_TRANSFER_READ_BIT, .write = false,
+        });
+        copy.accesses.push_back(Instance::Access{
+            .mapping = mapping, .host = true, .offset = range.offset, .size = range.size,
+            .stage = VK_PIPELINE_STAGE_2_COPY_BIT, .access = VK_ACCESS_2_TRANSFER_WRITE_BIT, .write = true,
+        });
+        host_read.accesses.push_back(Instance::Access{
+            .mapping = mapping, .host = true, .offset = range.offset, .size = range.size,
+            .stage = VK_PIPELINE_STAGE_2_HOST_BIT, .access = VK_ACCESS_2_HOST_READ_BIT, .write = false,
+        });
+    }
+
+    if (!mapping->unified()) {
+        instance->add_node(std::move(copy));
+    }
+    instance->add_node(std::move(host_read));
+    return this;
+}
+
+bool TransferStep::build()
+{
+    return true;
+}
+
+ComputeStep::ComputeStep(Instance* instance)
+    : instance(instance)
+    , update_template(VK_NULL_HANDLE)
+    , has_arguments(false)
+    , workgroup_dims({1, 1, 1})
+    , indirect_mapping(nullptr)
+    , indirect_offset(0)
+    , push_version(0)
+    , desc_layout(DL_SET_PER_BUFFER)
+    , pipeline_index(UINT32_MAX)
+    , shader_module(VK_NULL_HANDLE)
+    , pipeline_layout(VK_NULL_HANDLE)
+{
+}
+
+ComputeStep* ComputeStep::load_shader(const std::string_view& shader_path)
+{
+    shader_module = instance->get_shader_module(shader_path);
+    assert(shader_module != VK_NULL_HANDLE && "Load shader fro file failed");
+    return this;
+}
+
+ComputeStep* ComputeStep::load_shader(const void* shader, size_t size)
+{
+    shader_module = instance->get_shader_module(shader, size);
+    return this;
+}
+
+bool ComputeStep::build_comp_pipeline()
+{
+    if (shader_module == VK_NULL_HANDLE) {
+        return false;
+    }
+    pipeline_layout = instance->get_pipeline_layout(desc_set_layout, static_cast<uint32_t>(push_constants.size()));
+    // created with the other pending pipelines by Instance::compile()
+    pipeline_index = instance->get_pipeline(shader_module, pipeline_layout, spec_entries, spec_data);
+    return true;
+}
+
+ComputeStep* ComputeStep::set_outputs(const std::vector<MemMapping*>& output_mappings, bool write_only)
+{
+    used_mappings.insert(used_mappings.end(), output_mappings.begin(), output_mappings.end());
+    outputs.insert(outputs.end(), output_mappings.begin(), output_mappings.end());
+    write_only_outputs.insert(write_only_outputs.end(), output_mappings.size(), write_only);
+    return this;
+}
+
+ComputeStep* ComputeStep::set_inputs(const std::vector<MemMapping*>& input_mappings)
+{
+    used_mappings.insert(used_mappings.begin(), input_mappings.begin(), input_mappings.end());
+    inputs.insert(inputs.end(), input_mappings.begin(), input_mappings.end());
+    return this;
+}
+
+
+bool ComputeStep::build_descriptor_set()
+{
+    const uint32_t num_buffs{static_cast<uint32_t>(used_mappings.size())};
+    const bool single_set{desc_layout == DL_SINGLE_SET};
+    const uint32_t num_sets{single_set ? std::min(num_buffs, 1u) : num_buffs};
+    const uint32_t binding_count{single_set ? num_buffs : 1};
+    desc_set_layout.assign(num_sets, instance->get_set_layout(binding_count));
+    update_template = num_sets > 0 ? instance->get_update_template(binding_count) : VK_NULL_HANDLE;
+    has_arguments = std::any_of(used_mappings.begin(), used_mappings.end(), [](const MemMapping* mapping) {
+        return !mapping->name.empty();
+    });
+
+    desc_sets.resize(instance->frames_in_flight_);
+    for (uint32_t f = 0; f < desc_sets.size(); ++f) {
+        if (!instance->allocate_desc_sets(desc_set_layout, desc_sets.at(f))) {
+            return false;
+        }
+        // argument slots may still be unbound, they are written when recording
+        if (!has_arguments) {
+            write_descriptors(f);
+        }
+    }
+    return true;
+}
+
+void ComputeStep::write_descriptors(uint32_t frame)
+{
+    std::vector<VkDescriptorBufferInfo> buff_infos(used_mappings.size());
+    for (size_t i = 0; i < used_mappings.size(); ++i) {
+        buff_infos.at(i) = VkDescriptorBufferInfo{
+            .buffer = used_mappings.at(i)->buffers(frame).device_buff,
+            .offset = 0,
+            .range = VK_WHOLE_SIZE,
+        };
+    }
+
+    // a single set takes all buffer infos, one set per buffer takes one each
+    const auto& sets{desc_sets.at(frame)};
+    for (size_t i = 0; i < sets.size(); ++i) {
+        vkUpdateDescriptorSetWithTemplate(instance->device_, sets.at(i), update_template, &buff_infos.at(i));
+    }
+}
+
+ComputeStep* ComputeStep::set_push_constants(const void* data, uint32_t size)
+{
+    assert(data != nullptr && "Invalid pointer");
+    assert(size > 0 && size % 4 == 0 && "Push constant size must be a multiple of 4");
+
+    if (pipeline_index != UINT32_MAX) {
+        assert(size == push_constants.size() && "Push constant size is fixed by build()");
+        // only the command buffers recorded with the old values are recorded again
+        push_version = ++instance->patch_version_;
+    } else {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(instance->phy_device_, &properties);
+        assert(size <= properties.limits.maxPushConstantsSize && "Push constants exceed the device limit");
+    }
+
+    push_constants.assign(static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size);
+    return this;
+}
+
+ComputeStep* ComputeStep::set_spec_constant(uint32_t constant_id, const void* data, size_t size)
+{
+    assert(pipeline_index == UINT32_MAX && "Specialize before build()");
+
+    for (const auto& entry : spec_entries) {
+        if (entry.constantID == constant_id) {
+            assert(entry.size == size && "Specialization constant changed type");
+            memcpy(spec_data.data() + entry.offset, data, size);
+            return this;
+        }
+    }
+
+    spec_entries.push_back(VkSpecializationMapEntry{
+        .constantID = constant_id,
+        .offset = static_cast<uint32_t>(spec_data.size()),
+        .size = size,
+    });
+    spec_data.insert(spec_data.end(), static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + size);
+    return this;
+}
+
+ComputeStep* ComputeStep::set_local_size(uint32_t x, uint32_t y, uint32_t z,
+    uint32_t x_id, uint32_t y_id, uint32_t z_id)
+{
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(instance->phy_device_, &properties);
+    const auto& limits{properties.limits};
+    assert(x > 0 && y > 0 && z > 0 && "Bad local size");
+    assert(x <= limits.maxComputeWorkGroupSize[0] && y <= limits.maxComputeWorkGroupSize[1] &&
+        z <= limits.maxComputeWorkGroupSize[2] && "Local size exceeds the device limit");
+    assert(x * y * z <= limits.maxComputeWorkGroupInvocations && "Too many invocations per workgroup");
+
+    specialize(x_id, x);
+    specialize(y_id, y);
+    specialize(z_id, z);
+    return this;
+}
+
+ComputeStep* ComputeStep::apply(const TuneConfig& config)
+{
+    set_local_size(config.local_size.at(0), config.local_size.at(1), config.local_size.at(2));
+    for (const auto& [constant_id, value] : config.spec_constants) {
+        specialize(constant_id, value);
+    }
+    return this;
+}
 
+ComputeStep* ComputeStep::set_descriptor_layout(DescriptorLayout layout)
+{
+    desc_layout = layout;
     return this;
 }
 
-ComputeStep* ComputeStep::load_shader(const void* shader, size_t size)
+ComputeStep* ComputeStep::set_workgroup_dims(int x, int y, int z)
 {
-    VkShaderModuleCreateInfo create_info{};
-    create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    create_info.codeSize = size;
-    create_info.pCode = reinterpret_cast<const uint32_t*>(shader);
-    COV_CHECK_ASSERT(vkCreateShaderModule(instance->device_, &create_info, nullptr, &shader_module))
+    workgroup_dims.at(0) = x;
+    workgroup_dims.at(1) = y;
+    workgroup_dims.at(2) = z;
+    indirect_mapping = nullptr;
     return this;
 }
 
-bool ComputeStep::build_comp_pipeline()
+ComputeStep* ComputeStep::set_indirect_dims(MemMapping* mapping, VkDeviceSize offset)
 {
-    VkPipelineLayoutCreateInfo pipeline_create_info{};
-    pipeline_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipeline_create_info.setLayoutCount = desc_set_layout.size();
-    pipeline_create_info.pSetLayouts = desc_set_layout.data();
-    COV_CHECK_ASSERT(vkCreatePipelineLayout(instance->device_, &pipeline_create_info, nullptr, &pipeline_layout))
+    assert(mapping != nullptr && "Invalid memory mapping");
+    assert(offset % 4 == 0 && "Indirect offset must be a multiple of 4");
+    assert(offset + sizeof(VkDispatchIndirectCommand) <= mapping->size && "Indirect command out of range");
 
-    VkPipelineCacheCreateInfo pipeline_cache_create_info{};
-    pipeline_cache_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
-    COV_CHECK_ASSERT(vkCreatePipelineCache(instance->device_, &pipeline_cache_create_info, nullptr, &pipeline_cache))
+    indirect_mapping = mapping;
+    indirect_offset = offset;
+    return this;
+}
 
-    VkPipelineShaderStageCreateInfo shader_stage_create_info{};
-    shader_stage_create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    shader_stage_create_info.module = shader_module;
-    if (instance->spec_info_.mapEntryCount > 0) {
-        shader_stage_create_info.pSpecializationInfo = &instance->spec_info_;
-    } else {
-        shader_stage_create_info.pSpecializationInfo = VK_NULL_HANDLE;
+bool ComputeStep::build()
+{
+    TraceSpan span{instance, "build"};
+    // a step that cannot run never joins the graph
+    if (!build_descriptor_set() || !build_comp_pipeline()) {
+        return false;
     }
-    shader_stage_create_info.pName = "main";
-    shader_stage_create_info.stage = VK_SHADER_STAGE_COMPUTE_BIT;
 
-    VkComputePipelineCreateInfo comp_pipeline_create_info{};
-    comp_pipeline_create_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
-    comp_pipeline_create_info.stage = shader_stage_create_info;
-    comp_pipeline_create_info.layout = pipeline_layout;
-    comp_pipeline_create_info.flags = 0;
-    COV_CHECK_ASSERT(vkCreateComputePipelines(instance->device_, pipeline_cache, 1, &comp_pipeline_create_info, nullptr, &comp_pipeline))
+    Instance::Node node{
+        .kind = Instance::Node::NK_DISPATCH,
+        .transfer = false,
+        .step = this,
+    };
+    for (auto mapping : inputs) {
+        node.accesses.push_back(Instance::whole_buffer(mapping, false,
+            VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_READ_BIT, false));
+    }
+    // shaders may read their outputs, e.g. to accumulate, so the barriers
+    // before them must make earlier writes visible to reads as well
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        const VkAccessFlags2 read{write_only_outputs.at(i) ? VK_ACCESS_2_NONE : VK_ACCESS_2_SHADER_STORAGE_READ_BIT};
+        node.accesses.push_back(Instance::whole_buffer(outputs.at(i), false, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+            read | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, true));
+    }
+    if (indirect_mapping != nullptr) {
+        // ordered after the step writing the command like any other read
+        node.accesses.push_back(Instance::Access{
+            .mapping = indirect_mapping,
+            .host = false,
+            .offset = indirect_offset,
+            .size = sizeof(VkDispatchIndirectCommand),
+            .stage = VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,
+            .access = VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT,
+            .write = false,
+        });
+    }
+    instance->add_node(std::move(node));
     return true;
 }
 
-ComputeStep* ComputeStep::set_outputs(const std::vector<MemMapping*>& output_mappings)
+void ComputeStep::record(VkCommandBuffer cmd_buf, uint32_t frame) const
 {
-    used_mappings.insert(used_mappings.end(), output_mappings.begin(), output_mappings.end());
-    for (auto mapping : output_mappings) {
-        mapping->stage = MemMapping::AS_COMPUTE_W;
+    const auto& desc_set{desc_sets.at(frame)};
+    vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, instance->pipelines_.at(pipeline_index).pipeline);
+    vkCmdBindDescriptorSets(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline_layout,
+        0, desc_set.size(), desc_set.data(), 0, nullptr);
+    if (!push_constants.empty()) {
+        vkCmdPushConstants(cmd_buf, pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT,
+            0, static_cast<uint32_t>(push_constants.size()), push_constants.data());
+    }
+    if (indirect_mapping != nullptr) {
+        vkCmdDispatchIndirect(cmd_buf, indirect_mapping->buffers(frame).device_buff, indirect_offset);
+    } else {
+        vkCmdDispatch(cmd_buf, workgroup_dims.at(0), workgroup_dims.at(1), workgroup_dims.at(2));
     }
-    return this;
 }
 
-ComputeStep* ComputeStep::set_inputs(const std::vector<MemMapping*>& input_mappings)
+void ComputeStep::destroy() {
+    // pipelines, layouts and shader modules belong to the instance caches
+    pipeline_index = UINT32_MAX;
+}
+
+ComputeStep* gemm(Instance& instance, MemMapping* A, MemMapping* B, MemMapping* C, const GemmOptions& opts)
 {
-    mem_buf_barriers.resize(input_mappings.size());
-    for (size_t i = 0; i < input_mappings.size(); ++i) {
-        auto& mapping{input_mappings.at(i)};
-        if (mapping->stage != MemMapping::AS_TRANSFER_W && mapping->stage != MemMapping::AS_COMPUTE_W) {
-            continue;
-        }
+    assert(A != nullptr && B != nullptr && C != nullptr && "Invalid memory mapping");
+    assert(opts.m > 0 && opts.n > 0 && opts.k > 0 && "Empty matrix");
+    assert(A->bytes() >= sizeof(float) * opts.m * opts.k && "A is smaller than m x k");
+    assert(B->bytes() >= sizeof(float) * opts.k * opts.n && "B is smaller than k x n");
+    assert(C->bytes() >= sizeof(float) * opts.m * opts.n && "C is smaller than m x n");
+    assert(!opts.shader_path.empty() && "GemmOptions::shader_path must name the compiled gemm.comp");
+    assert(opts.tm > 0 && opts.tn > 0 && opts.bk > 0 && "Bad tile size");
+
+    const uint32_t bm{opts.wg_y * opts.tm};
+    const uint32_t bn{opts.wg_x * opts.tn};
+    const auto limits{instance.limits()};
+    assert(sizeof(float) * opts.bk * (bm + bn) <= limits.maxComputeSharedMemorySize &&
+        "Tiles exceed the shared memory limit");
+    assert((opts.n + bn - 1) / bn <= limits.maxComputeWorkGroupCount[0] &&
+        (opts.m + bm - 1) / bm <= limits.maxComputeWorkGroupCount[1] && "Too many workgroups");
+
+    struct Params
+    {
+        uint32_t m;
+        uint32_t n;
+        uint32_t k;
+        float alpha;
+        float beta;
+    } params{opts.m, opts.n, opts.k, opts.alpha, opts.beta};
+    const bool vec4{opts.vectorize && opts.k % 4 == 0 && opts.n % 4 == 0 && opts.bk % 4 == 0 && bn % 4 == 0};
+
+    auto step{instance.add_compute_step()
+        ->load_shader(opts.shader_path)
+        ->set_descriptor_layout(ComputeStep::DL_SINGLE_SET)
+        ->set_inputs({A, B})
+        // C is read back when beta is not 0
+        ->set_outputs({C}, opts.beta == 0.0f)
+        ->set_local_size(opts.wg_x, opts.wg_y, 1)
+        ->specialize(3, opts.tm)
+        ->specialize(4, opts.tn)
+        ->specialize(5, opts.bk)
+        ->specialize(6, vec4)
+        ->set_push_constants(params)
+        ->set_workgroup_dims((opts.n + bn - 1) / bn, (opts.m + bm - 1) / bm, 1)};
+    return step->build() ? step : nullptr;
+}
 
-        auto& mem_barrier{mem_buf_barriers.at(i)};
-        mem_barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-        mem_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        mem_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        mem_barrier.buffer = mapping->device_buff;
-        mem_barrier.size = VK_WHOLE_SIZE;
-        if (mapping->stage == MemMapping::AS_TRANSFER_W) {
-            mem_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        } else if (mapping->stage == MemMapping::AS_COMPUTE_W) {
-            mem_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-        }
-        mem_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+Tuner::Tuner(Instance& instance, std::string_view path)
+    : instance_(&instance)
+    , path_(path)
+    , iterations_(5)
+{
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(instance.phy_device_, &properties);
+    limits_ = properties.limits;
+
+    std::ostringstream header;
+    header << "cov-tuning 1 " << properties.vendorID << " " << properties.deviceID << " "
+        << properties.driverVersion << " " << std::hex << std::setfill('0');
+    for (uint32_t i = 0; i < VK_UUID_SIZE; ++i) {
+        header << std::setw(2) << static_cast<uint32_t>(properties.pipelineCacheUUID[i]);
     }
+    header_ = header.str();
 
-    used_mappings.insert(used_mappings.begin(), input_mappings.begin(), input_mappings.end());
-    return this;
+    if (!path_.empty()) {
+        load();
+    }
 }
 
+Tuner* Tuner::set_iterations(uint32_t iterations)
+{
+    assert(iterations > 0 && "At least one timed run per candidate");
+    iterations_ = iterations;
+    return this;
+}
 
-bool ComputeStep::build_descriptor_set()
+std::optional<TuneConfig> Tuner::tune(std::string_view key, const std::vector<TuneConfig>& candidates,
+    const StepFactory& add_step)
 {
-    desc_set.resize(used_mappings.size());
-    desc_set_layout.resize(used_mappings.size());
+    assert(!key.empty() && key.find_first_of("\t\n") == std::string_view::npos && "Keys are single line without tabs");
 
-    std::vector<VkDescriptorPoolSize> pool_sizes{
-        VkDescriptorPoolSize{.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = static_cast<uint32_t>(used_mappings.size())}
-    };
-    VkDescriptorPoolCreateInfo pool_create_info{};
-    pool_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    pool_create_info.poolSizeCount = static_cast<uint32_t>(pool_sizes.size());
-    pool_create_info.pPoolSizes = pool_sizes.data();
-    pool_create_info.maxSets = used_mappings.size();
-    COV_CHECK_ASSERT(vkCreateDescriptorPool(instance->device_, &pool_create_info, nullptr, &desc_pool))
+    if (auto found{find(key)}) {
+        return found;
+    }
 
-    std::vector<VkDescriptorSetLayoutBinding> set_layout_bindings{
-        VkDescriptorSetLayoutBinding{
-            .binding = 0,
-            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-            .descriptorCount = 1,
-            .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT
+    std::optional<TuneConfig> best;
+    for (const auto& candidate : candidates) {
+        if (!fits(candidate)) {
+            continue;
+        }
+        const double duration_ns{measure(candidate, add_step)};
+        if (duration_ns >= 0.0 && (!best || duration_ns < best->duration_ns)) {
+            best = candidate;
+            best->duration_ns = duration_ns;
         }
-    };
-
-    VkDescriptorSetLayoutCreateInfo layout_create_info{};
-    layout_create_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-    layout_create_info.bindingCount = static_cast<uint32_t>(set_layout_bindings.size());
-    layout_create_info.pBindings = set_layout_bindings.data();
-    for (size_t i = 0; i < used_mappings.size(); ++i) {
-        COV_CHECK_ASSERT(vkCreateDescriptorSetLayout(instance->device_, &layout_create_info, nullptr, &desc_set_layout.at(i)))
     }
 
-    VkDescriptorSetAllocateInfo desc_alloc_info{};
-    desc_alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    desc_alloc_info.descriptorSetCount = used_mappings.size();
-    desc_alloc_info.descriptorPool = desc_pool;
-    desc_alloc_info.pSetLayouts = desc_set_layout.data();
-    COV_CHECK_ASSERT(vkAllocateDescriptorSets(instance->device_, &desc_alloc_info, desc_set.data()))
-
-    std::vector<VkDescriptorBufferInfo> desc_buff_info(used_mappings.size());
-    for (size_t i = 0; i < used_mappings.size(); ++i) {
-        const auto& mapping{used_mappings.at(i)};
-        desc_buff_info[i].range = VK_WHOLE_SIZE;
-        desc_buff_info[i].offset = 0;
-        desc_buff_info[i].buffer = mapping->device_buff;
+    if (best) {
+        results_.emplace_back(std::string(key), *best);
+        if (!path_.empty()) {
+            save();
+        }
     }
+    return best;
+}
 
-    std::vector<VkWriteDescriptorSet> write_desc_sets;
-    write_desc_sets.reserve(used_mappings.size());
-    for (size_t i = 0; i < used_mappings.size(); ++i) {
-        write_desc_sets.emplace_back(VkWriteDescriptorSet{
-            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-            .dstSet = desc_set.at(i),
-            .dstBinding = 0,
-            .descriptorCount = 1,
-            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-            .pBufferInfo = &desc_buff_info.at(i)
-        });
+std::optional<TuneConfig> Tuner::find(std::string_view key) const
+{
+    for (const auto& [result_key, config] : results_) {
+        if (result_key == key) {
+            return config;
+        }
     }
-
-    vkUpdateDescriptorSets(instance->device_, write_desc_sets.size(), write_desc_sets.data(), 0, nullptr);
-    return this;
+    return std::nullopt;
 }
 
-ComputeStep* ComputeStep::set_workgroup_dims(int x, int y, int z)
+bool Tuner::fits(const TuneConfig& config) const
 {
-    workgroup_dims.at(0) = x;
-    workgroup_dims.at(1) = y;
-    workgroup_dims.at(2) = z;
-    return this;
+    const auto& size{config.local_size};
+    return size.at(0) > 0 && size.at(1) > 0 && size.at(2) > 0 &&
+        size.at(0) <= limits_.maxComputeWorkGroupSize[0] &&
+        size.at(1) <= limits_.maxComputeWorkGroupSize[1] &&
+        size.at(2) <= limits_.maxComputeWorkGroupSize[2] &&
+        size.at(0) * size.at(1) * size.at(2) <= limits_.maxComputeWorkGroupInvocations;
 }
 
-bool ComputeStep::build()
+double Tuner::measure(const TuneConfig& config, const StepFactory& add_step)
 {
-    build_descriptor_set();
-    build_comp_pipeline();
-    instance->try_begin_cmd_buf();
+    auto& instance{*instance_};
+    assert(instance.nodes_.empty() && instance.mem_mappings_.empty() && "The tuning instance runs candidates only");
+    const bool profiling{instance.profiling_};
+    instance.set_profiling(true);
+    const ComputeStep* step{add_step(instance, config)};
+
+    // the first run compiles the graph
+    bool measured{step != nullptr && instance.execute()};
+    double best_ns{0.0};
+    for (uint32_t i = 0; measured && i < iterations_; ++i) {
+        // device time only, wall time would not compare with the other candidates
+        std::optional<double> duration_ns;
+        if (instance.execute()) {
+            for (const auto& timing : instance.profile()) {
+                if (timing.compute_step == step) {
+                    duration_ns = timing.duration_ns;
+                }
+            }
+        }
+        measured = duration_ns.has_value();
+        if (measured) {
+            best_ns = i == 0 ? *duration_ns : std::min(best_ns, *duration_ns);
+        }
+    }
 
-    if (!mem_buf_barriers.empty()) {
-        std::vector<VkBufferMemoryBarrier> transfer_stage_barriers;
-        std::vector<VkBufferMemoryBarrier> compute_stage_barriers;
+    instance.clear_graph();
+    instance.set_profiling(profiling);
+    return measured ? best_ns : -1.0;
+}
 
-        for (auto& it : mem_buf_barriers) {
-            if (it.srcAccessMask == VK_ACCESS_TRANSFER_WRITE_BIT) {
-                transfer_stage_barriers.push_back(it);
-            } else {
-                compute_stage_barriers.push_back(it);
-            }
+// One line per key: key, tab, local size, duration and the (id, value) pairs
+bool Tuner::load()
+{
+    std::ifstream ifs(path_);
+    if (!ifs.is_open()) {
+        return false;
+    }
+    std::string line;
+    if (!std::getline(ifs, line) || line != header_) {
+        // written for another device or driver, it is replaced on save
+        return false;
+    }
+
+    while (std::getline(ifs, line)) {
+        const auto tab{line.find('\t')};
+        if (tab == std::string::npos) {
+            continue;
+        }
+        std::istringstream fields(line.substr(tab + 1));
+        TuneConfig config;
+        size_t count{0};
+        fields >> config.local_size.at(0) >> config.local_size.at(1) >> config.local_size.at(2)
+            >> config.duration_ns >> count;
+        config.spec_constants.resize(count);
+        for (auto& [constant_id, value] : config.spec_constants) {
+            fields >> constant_id >> value;
+        }
+        if (!fields.fail()) {
+            results_.emplace_back(line.substr(0, tab), std::move(config));
         }
+    }
+    return true;
+}
 
-        if (!transfer_stage_barriers.empty()) {
-            vkCmdPipelineBarrier(instance->cmd_buf_, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
-                0, nullptr,
-                transfer_stage_barriers.size(), transfer_stage_barriers.data(),
-                0, nullptr);
+bool Tuner::save() const
+{
+    assert(!path_.empty() && "No tuning file path set");
+
+    // write aside and rename, readers never see a partially written file
+    const std::string tmp_path{path_ + ".tmp"};
+    {
+        std::ofstream ofs(tmp_path, std::ios::out | std::ios::trunc);
+        if (!ofs.is_open()) {
+            return false;
         }
-        if (!compute_stage_barriers.empty()) {
-            vkCmdPipelineBarrier(instance->cmd_buf_, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
-                0, nullptr,
-                compute_stage_barriers.size(), compute_stage_barriers.data(),
-                0, nullptr);
+        ofs << header_ << "\n";
+        for (const auto& [key, config] : results_) {
+            ofs << key << "\t" << config.local_size.at(0) << " " << config.local_size.at(1) << " "
+                << config.local_size.at(2) << " " << config.duration_ns << " " << config.spec_constants.size();
+            for (const auto& [constant_id, value] : config.spec_constants) {
+                ofs << " " << constant_id << " " << value;
+            }
+            ofs << "\n";
+        }
+        ofs.flush();
+        if (!ofs.good()) {
+            std::remove(tmp_path.c_str());
+            return false;
         }
     }
+    return std::rename(tmp_path.c_str(), path_.c_str()) == 0;
+}
 
-    vkCmdBindPipeline(instance->cmd_buf_, VK_PIPELINE_BIND_POINT_COMPUTE, comp_pipeline);
-    vkCmdBindDescriptorSets(instance->cmd_buf_, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline_layout,
-        0, desc_set.size(), desc_set.data(), 0, nullptr);
-    vkCmdDispatch(instance->cmd_buf_, workgroup_dims.at(0), workgroup_dims.at(1), workgroup_dims.at(2));
+// `opts` with the local size and tiles of a gemm.comp TuneConfig
+static GemmOptions gemm_tiles(GemmOptions opts, const TuneConfig& config)
+{
+    opts.wg_x = config.local_size.at(0);
+    opts.wg_y = config.local_size.at(1);
+    for (const auto& [constant_id, value] : config.spec_constants) {
+        switch (constant_id) {
+        case 3: opts.tm = value; break;
+        case 4: opts.tn = value; break;
+        case 5: opts.bk = value; break;
+        default: break;
+        }
+    }
+    return opts;
+}
 
-    vkDestroyShaderModule(instance->device_, shader_module, nullptr);
-    vkDestroyPipelineCache(instance->device_, pipeline_cache, nullptr);
-    vkDestroyPipelineLayout(instance->device_, pipeline_layout, nullptr);
-    for (auto dsl : desc_set_layout) {
-        vkDestroyDescriptorSetLayout(instance->device_, dsl, nullptr);
+// gemm.comp configurations that gemm() accepts for the shape of `opts`
+static std::vector<TuneConfig> gemm_candidates(const VkPhysicalDeviceLimits& limits, const GemmOptions& opts)
+{
+    const std::vector<std::array<uint32_t, 2>> local_sizes{{8, 8}, {16, 8}, {16, 16}, {32, 8}};
+    const std::vector<std::array<uint32_t, 2>> blocks{{1, 1}, {2, 2}, {4, 4}, {4, 8}, {8, 4}, {8, 8}};
+    const std::vector<uint32_t> depths{8, 16};
+
+    std::vector<TuneConfig> candidates;
+    for (const auto& [wg_x, wg_y] : local_sizes) {
+        for (const auto& [tm, tn] : blocks) {
+            for (const auto bk : depths) {
+                const uint32_t bm{wg_y * tm};
+                const uint32_t bn{wg_x * tn};
+                if (sizeof(float) * bk * (bm + bn) > limits.maxComputeSharedMemorySize ||
+                    (opts.n + bn - 1) / bn > limits.maxComputeWorkGroupCount[0] ||
+                    (opts.m + bm - 1) / bm > limits.maxComputeWorkGroupCount[1]) {
+                    continue;
+                }
+                candidates.push_back(TuneConfig{
+                    .local_size = {wg_x, wg_y, 1},
+                    .spec_constants = {{3, tm}, {4, tn}, {5, bk}},
+                });
+            }
+        }
     }
-    return true;
+    return candidates;
 }
 
-void ComputeStep::destroy(VkDevice device) {
-    vkDestroyPipeline(device, comp_pipeline, nullptr);
-    vkDestroyDescriptorPool(device, desc_pool, nullptr);
+GemmOptions tune_gemm(Tuner& tuner, const GemmOptions& opts)
+{
+    const std::string key{"gemm " + std::to_string(opts.m) + "x" + std::to_string(opts.n) + "x" +
+        std::to_string(opts.k) + (opts.vectorize ? " vec4" : "")};
+    const auto config{tuner.tune(key, gemm_candidates(tuner.limits(), opts),
+        [&opts](Instance& instance, const TuneConfig& config) {
+            auto A{instance.add_mem_mapping(sizeof(float) * opts.m * opts.k)};
+            auto B{instance.add_mem_mapping(sizeof(float) * opts.k * opts.n)};
+            auto C{instance.add_mem_mapping(sizeof(float) * opts.m * opts.n)};
+            return gemm(instance, A, B, C, gemm_tiles(opts, config));
+        })};
+    return config ? gemm_tiles(opts, *config) : opts;
 }
 
 LayerExtensions::LayerExtensions()
@@ -961,13 +4132,27 @@ bool PhysicalDevice::property_available(VkPhysicalDevice device)
         return false;
     }
 
-    // VkPhysicalDeviceProperties properties;
-    // VkPhysicalDeviceFeatures features;
-
-    // vkGetPhysicalDeviceProperties(device, &properties);
-    // vkGetPhysicalDeviceFeatures(device, &features);
+    // barriers are recorded with vkCmdPipelineBarrier2
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device, &properties);
+    if (properties.apiVersion < VK_API_VERSION_1_3) {
+        return false;
+    }
 
-    return true;
+    // profiling resets its query pools from the host
+    VkPhysicalDeviceHostQueryResetFeatures host_query_reset_features{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_QUERY_RESET_FEATURES,
+    };
+    VkPhysicalDeviceSynchronization2Features sync2_features{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES,
+        .pNext = &host_query_reset_features,
+    };
+    VkPhysicalDeviceFeatures2 features{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &sync2_features,
+    };
+    vkGetPhysicalDeviceFeatures2(device, &features);
+    return sync2_features.synchronization2 == VK_TRUE && host_query_reset_features.hostQueryReset == VK_TRUE;
 }
 
 std::optional<uint32_t> PhysicalDevice::find_available_queue(VkPhysicalDevice device)
@@ -993,30 +4178,113 @@ std::optional<uint32_t> PhysicalDevice::find_available_queue(VkPhysicalDevice de
     return result;
 }
 
+std::optional<uint32_t> PhysicalDevice::find_transfer_queue(VkPhysicalDevice device)
+{
+    if (device == VK_NULL_HANDLE) {
+        return std::nullopt;
+    }
+
+    std::optional<uint32_t> result;
+    uint32_t que_family_count{0};
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &que_family_count, nullptr);
+    std::vector<VkQueueFamilyProperties> que_family_properties(que_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(device, &que_family_count, que_family_properties.data());
+
+    // a transfer only family is usually backed by the copy engines (DMA)
+    for (uint32_t i = 0; i < que_family_count; ++i) {
+        const auto& que{que_family_properties.at(i)};
+        if ((que.queueFlags & VK_QUEUE_TRANSFER_BIT) &&
+            !(que.queueFlags & (VK_QUEUE_COMPUTE_BIT | VK_QUEUE_GRAPHICS_BIT))) {
+            result = i;
+            break;
+        }
+    }
+
+    return result;
+}
+
+bool PhysicalDevice::has_extension(VkPhysicalDevice device, const char* ext_name)
+{
+    uint32_t count{0};
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &count, nullptr);
+    std::vector<VkExtensionProperties> exts(count);
+    vkEnumerateDeviceExtensionProperties(device, nullptr, &count, exts.data());
+    for (const auto& ext : exts) {
+        if (std::strcmp(ext_name, ext.extensionName) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void PhysicalDevice::properties(VkPhysicalDevice device, VkPhysicalDeviceProperties& properties)
 {
     vkGetPhysicalDeviceProperties(device, &properties);
 }
 
+bool PhysicalDevice::has_unified_memory(VkPhysicalDevice device)
+{
+    if (device == VK_NULL_HANDLE) {
+        return false;
+    }
+
+    // discrete GPUs may expose a small host visible window of VRAM (BAR),
+    // only integrated GPUs and CPU implementations share memory with the host
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(device, &properties);
+    if (properties.deviceType != VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU &&
+        properties.deviceType != VK_PHYSICAL_DEVICE_TYPE_CPU) {
+        return false;
+    }
+
+    const VkMemoryPropertyFlags unified_flags{VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT};
+    VkPhysicalDeviceMemoryProperties mem_properies;
+    vkGetPhysicalDeviceMemoryProperties(device, &mem_properies);
+    for (uint32_t i = 0; i < mem_properies.memoryTypeCount; ++i) {
+        if ((mem_properies.memoryTypes[i].propertyFlags & unified_flags) == unified_flags) {
+            return true;
+        }
+    }
+    return false;
+}
+
 Device::Device() {}
 
-bool Device::create(VkPhysicalDevice phy_device, uint32_t queue_index, VkDevice& device, VkQueue& queue)
+bool Device::create(VkPhysicalDevice phy_device, uint32_t queue_index, uint32_t transfer_queue_index,
+    const std::vector<const char*>& extensions, VkDevice& device, VkQueue& queue, VkQueue& transfer_queue)
 {
     const float queue_priority{1.0f}; // 0.0f~1.0f
 
-    VkDeviceQueueCreateInfo que_create_info{};
-    que_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    que_create_info.queueCount = 1;
-    que_create_info.queueFamilyIndex = queue_index;
-    que_create_info.pQueuePriorities = &queue_priority;
+    std::array<VkDeviceQueueCreateInfo, 2> que_create_infos{};
+    for (auto& que_create_info : que_create_infos) {
+        que_create_info.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+        que_create_info.queueCount = 1;
+        que_create_info.pQueuePriorities = &queue_priority;
+    }
+    que_create_infos.at(0).queueFamilyIndex = queue_index;
+    que_create_infos.at(1).queueFamilyIndex = transfer_queue_index;
+    const uint32_t que_create_info_count{transfer_queue_index != queue_index ? 2u : 1u};
 
     VkPhysicalDeviceFeatures device_features{};
+    VkPhysicalDeviceHostQueryResetFeatures host_query_reset_features{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_QUERY_RESET_FEATURES,
+        .hostQueryReset = VK_TRUE,
+    };
+    VkPhysicalDeviceSynchronization2Features sync2_features{
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES,
+        .pNext = &host_query_reset_features,
+        .synchronization2 = VK_TRUE,
+    };
 
     VkDeviceCreateInfo create_info{};
     create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-    create_info.pQueueCreateInfos = &que_create_info;
-    create_info.queueCreateInfoCount = 1;
+    create_info.pNext = &sync2_features;
+    create_info.pQueueCreateInfos = que_create_infos.data();
+    create_info.queueCreateInfoCount = que_create_info_count;
     create_info.pEnabledFeatures = &device_features;
+    create_info.enabledExtensionCount = static_cast<uint32_t>(extensions.size());
+    create_info.ppEnabledExtensionNames = extensions.data();
 #if COV_ENABLE_VALIDATION
     CHECK_VALIDATION_AVAILABLE();
     create_info.ppEnabledLayerNames = cov_validation_layers.data();
@@ -1030,6 +4298,7 @@ bool Device::create(VkPhysicalDevice phy_device, uint32_t queue_index, VkDevice&
     }
 
     vkGetDeviceQueue(device, queue_index, 0, &queue);
+    vkGetDeviceQueue(device, transfer_queue_index, 0, &transfer_queue);
     return true;
 }
 
@@ -1040,8 +4309,8 @@ void Device::destroy(VkDevice device)
     }
 }
 
-bool create_buffer(VkDevice device, VkPhysicalDevice phy_device, size_t size, VkBufferUsageFlags usage,
-    VkMemoryPropertyFlags property_flags, VkBuffer& buff, VkDeviceMemory& memory)
+bool create_buffer(VkDevice device, MemoryAllocator& allocator, size_t size, VkBufferUsageFlags usage,
+    VkMemoryPropertyFlags property_flags, VkBuffer& buff, Allocation& alloc)
 {
     // create buffer
     VkBufferCreateInfo buff_create_info{};
@@ -1055,31 +4324,246 @@ bool create_buffer(VkDevice device, VkPhysicalDevice phy_device, size_t size, Vk
     VkMemoryRequirements mem_reqs;
     vkGetBufferMemoryRequirements(device, buff, &mem_reqs);
 
+    if (!allocator.allocate(mem_reqs, property_flags, alloc)) {
+        vkDestroyBuffer(device, buff, nullptr);
+        buff = VK_NULL_HANDLE;
+        return false;
+    }
+
+    COV_CHECK_ASSERT(vkBindBufferMemory(device, buff, alloc.memory, alloc.offset))
+    return true;
+}
+
+MemoryAllocator::MemoryAllocator()
+    : device_(VK_NULL_HANDLE)
+    , mem_properties_{}
+    , block_size_(0)
+    , device_allocations_(0)
+{
+}
+
+void MemoryAllocator::init(VkDevice device, VkPhysicalDevice phy_device, VkDeviceSize block_size)
+{
+    device_ = device;
+    block_size_ = block_size;
+    vkGetPhysicalDeviceMemoryProperties(phy_device, &mem_properties_);
+}
+
+std::optional<uint32_t> MemoryAllocator::find_memory_type(uint32_t type_bits, VkMemoryPropertyFlags property_flags) const
+{
+    for (uint32_t i = 0; i < mem_properties_.memoryTypeCount; ++i) {
+        if ((type_bits & (1u << i)) &&
+            (mem_properties_.memoryTypes[i].propertyFlags & property_flags) == property_flags) {
+            return i;
+        }
+    }
+    return std::nullopt;
+}
+
+bool MemoryAllocator::allocate_block(uint32_t memory_type, VkDeviceSize size, bool dedicated, uint32_t& block_index)
+{
     VkMemoryAllocateInfo mem_alloc_info{};
     mem_alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    mem_alloc_info.allocationSize = mem_reqs.size;
+    mem_alloc_info.allocationSize = size;
+    mem_alloc_info.memoryTypeIndex = memory_type;
+
+    Block block{
+        .memory = VK_NULL_HANDLE,
+        .size = size,
+        .used = 0,
+        .memory_type = memory_type,
+        .allocation_count = 0,
+        .dedicated = dedicated,
+        .mapped = nullptr,
+        .free_ranges = {Range{.offset = 0, .size = size}}
+    };
+    COV_CHECK_FALSE(vkAllocateMemory(device_, &mem_alloc_info, nullptr, &block.memory))
+    ++device_allocations_;
+
+    if (mem_properties_.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        const VkResult result{vkMapMemory(device_, block.memory, 0, VK_WHOLE_SIZE, 0, &block.mapped)};
+        if (result != VK_SUCCESS) {
+            std::cerr << "Vulkan Failed with error: " << stringify(result) << "\n";
+            // the block never existed as far as the stats are concerned
+            vkFreeMemory(device_, block.memory, nullptr);
+            --device_allocations_;
+            return false;
+        }
+    }
 
-    VkPhysicalDeviceMemoryProperties mem_properies;
-    vkGetPhysicalDeviceMemoryProperties(phy_device, &mem_properies);
-
-    bool mem_satisfied{false};
-    for (int i = 0; i < mem_properies.memoryTypeCount; ++i) {
-        if ((mem_reqs.memoryTypeBits & 0x1) &&
-            (mem_properies.memoryTypes[i].propertyFlags & property_flags) == property_flags) {
-            mem_satisfied = true;
-            mem_alloc_info.memoryTypeIndex = i;
-            break;
+    // reuse the slot of a released block so indices held by allocations stay valid
+    for (uint32_t i = 0; i < blocks_.size(); ++i) {
+        if (blocks_.at(i).memory == VK_NULL_HANDLE) {
+            blocks_.at(i) = std::move(block);
+            block_index = i;
+            return true;
+        }
+    }
+    blocks_.push_back(std::move(block));
+    block_index = static_cast<uint32_t>(blocks_.size() - 1);
+    return true;
+}
+
+bool MemoryAllocator::suballocate(uint32_t block_index, const VkMemoryRequirements& reqs, Allocation& alloc)
+{
+    auto& block{blocks_.at(block_index)};
+    const VkDeviceSize alignment{reqs.alignment > 0 ? reqs.alignment : 1};
+
+    for (size_t i = 0; i < block.free_ranges.size(); ++i) {
+        const auto range{block.free_ranges.at(i)};
+        const VkDeviceSize offset{(range.offset + alignment - 1) / alignment * alignment};
+        const VkDeviceSize padding{offset - range.offset};
+        if (range.size < padding + reqs.size) {
+            continue;
+        }
+
+        // keep the alignment padding and the tail in the free list
+        const Range tail{.offset = offset + reqs.size, .size = range.size - padding - reqs.size};
+        if (padding > 0) {
+            block.free_ranges.at(i).size = padding;
+            if (tail.size > 0) {
+                block.free_ranges.insert(block.free_ranges.begin() + i + 1, tail);
+            }
+        } else if (tail.size > 0) {
+            block.free_ranges.at(i) = tail;
+        } else {
+            block.free_ranges.erase(block.free_ranges.begin() + i);
         }
-        mem_reqs.memoryTypeBits >>= 1;
+
+        block.used += reqs.size;
+        ++block.allocation_count;
+        alloc.memory = block.memory;
+        alloc.offset = offset;
+        alloc.size = reqs.size;
+        alloc.mapped = block.mapped ? static_cast<char*>(block.mapped) + offset : nullptr;
+        alloc.block = block_index;
+        return true;
     }
+    return false;
+}
 
-    if (!mem_satisfied) {
+bool MemoryAllocator::allocate(const VkMemoryRequirements& reqs, VkMemoryPropertyFlags property_flags, Allocation& alloc)
+{
+    const auto memory_type{find_memory_type(reqs.memoryTypeBits, property_flags)};
+    if (!memory_type.has_value()) {
         return false;
     }
 
-    COV_CHECK_ASSERT(vkAllocateMemory(device, &mem_alloc_info, nullptr, &memory))
-    COV_CHECK_ASSERT(vkBindBufferMemory(device, buff, memory, 0))
-    return true;
+    uint32_t block_index;
+    // oversized requests get a block of their own rather than wasting most of a shared one
+    if (reqs.size > block_size_ / 2) {
+        return allocate_block(memory_type.value(), reqs.size, true, block_index) &&
+            suballocate(block_index, reqs, alloc);
+    }
+
+    for (uint32_t i = 0; i < blocks_.size(); ++i) {
+        const auto& block{blocks_.at(i)};
+        if (block.memory == VK_NULL_HANDLE || block.dedicated || block.memory_type != memory_type.value()) {
+            continue;
+        }
+        if (suballocate(i, reqs, alloc)) {
+            return true;
+        }
+    }
+
+    return allocate_block(memory_type.value(), block_size_, false, block_index) &&
+        suballocate(block_index, reqs, alloc);
+}
+
+void MemoryAllocator::free(Allocation& alloc)
+{
+    if (alloc.memory == VK_NULL_HANDLE) {
+        return;
+    }
+
+    const uint32_t block_index{alloc.block};
+    auto& block{blocks_.at(block_index)};
+    auto& ranges{block.free_ranges};
+
+    // insert sorted and coalesce with the neighbours
+    auto it{ranges.begin()};
+    while (it != ranges.end() && it->offset < alloc.offset) {
+        ++it;
+    }
+    it = ranges.insert(it, Range{.offset = alloc.offset, .size = alloc.size});
+    if (it + 1 != ranges.end() && it->offset + it->size == (it + 1)->offset) {
+        it->size += (it + 1)->size;
+        ranges.erase(it + 1);
+    }
+    if (it != ranges.begin() && (it - 1)->offset + (it - 1)->size == it->offset) {
+        (it - 1)->size += it->size;
+        ranges.erase(it);
+    }
+
+    block.used -= alloc.size;
+    --block.allocation_count;
+    alloc = Allocation{};
+
+    if (block.allocation_count > 0) {
+        return;
+    }
+    if (block.dedicated) {
+        free_block(block_index);
+        return;
+    }
+    // keep one empty block per memory type around for reuse
+    for (uint32_t i = 0; i < blocks_.size(); ++i) {
+        const auto& other{blocks_.at(i)};
+        if (i != block_index && other.memory != VK_NULL_HANDLE && !other.dedicated &&
+            other.memory_type == block.memory_type && other.allocation_count == 0) {
+            free_block(block_index);
+            return;
+        }
+    }
+}
+
+void MemoryAllocator::free_block(uint32_t block_index)
+{
+    auto& block{blocks_.at(block_index)};
+    if (block.mapped) {
+        vkUnmapMemory(device_, block.memory);
+    }
+    vkFreeMemory(device_, block.memory, nullptr);
+    block = Block{};
+}
+
+void MemoryAllocator::destroy()
+{
+    if (device_ == VK_NULL_HANDLE) {
+        return;
+    }
+    for (uint32_t i = 0; i < blocks_.size(); ++i) {
+        if (blocks_.at(i).memory != VK_NULL_HANDLE) {
+            free_block(i);
+        }
+    }
+    blocks_.clear();
+    device_ = VK_NULL_HANDLE;
+}
+
+MemoryStats MemoryAllocator::stats() const
+{
+    MemoryStats stats{};
+    stats.device_allocations = device_allocations_;
+    for (const auto& block : blocks_) {
+        if (block.memory == VK_NULL_HANDLE) {
+            continue;
+        }
+        ++stats.block_count;
+        if (block.dedicated) {
+            ++stats.dedicated_block_count;
+        }
+        stats.allocation_count += block.allocation_count;
+        stats.reserved_bytes += block.size;
+        stats.used_bytes += block.used;
+        const bool device_local{(mem_properties_.memoryTypes[block.memory_type].propertyFlags &
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) != 0};
+        (device_local ? stats.device_local_bytes : stats.host_bytes) += block.used;
+        for (const auto& range : block.free_ranges) {
+            stats.largest_free_range = std::max(stats.largest_free_range, range.size);
+        }
+    }
+    return stats;
 }
 
 std::string stringify(VkResult result)
@@ -1,3 +1,5 @@
+#include <cstring>
+
 #include "mat.hpp"
 
 #define COV_VULKAN_VALIDATION
@@ -5,10 +7,67 @@
 #include "cov.hpp"
 
 
-int main()
+// C = A * B and E = C * D with the command buffers recorded by `record_threads`
+bool run_multi_step(uint32_t record_threads, Mat& A, Mat& B, Mat& C, Mat& D, Mat& E)
 {
     const std::string shader_path{"../examples/shader/matmul.comp.spv"};  // suppose we run this program on build dir
 
+    // create instance
+    auto instance{cov::Vulkan::new_instance()};
+    instance.set_record_threads(record_threads);
+    // create data mapping
+    auto A_mapping{instance.add_mem_mapping(A.bytes())};
+    auto B_mapping{instance.add_mem_mapping(B.bytes())};
+    auto C_mapping{instance.add_mem_mapping(C.bytes())};
+    auto D_mapping{instance.add_mem_mapping(D.bytes())};
+    auto E_mapping{instance.add_mem_mapping(E.bytes())};
+
+    {
+        // buid compute pipeline
+        instance.add_transfer_step()
+            ->to_device(A_mapping)
+            ->to_device(B_mapping)
+            ->to_device(D_mapping)
+            ->build();
+
+        instance.add_compute_step()
+            ->load_shader(shader_path)
+            ->set_inputs({A_mapping, B_mapping})
+            ->set_outputs({C_mapping})
+            ->set_workgroup_dims(C.row, C.col, 1)
+            ->build();
+
+        instance.add_compute_step()
+            ->load_shader(shader_path)
+            ->set_inputs({C_mapping, D_mapping})
+            ->set_outputs({E_mapping})
+            ->set_workgroup_dims(E.row, E.col, 1)
+            ->build();
+
+        instance.add_transfer_step()
+            ->from_device(C_mapping)
+            ->from_device(E_mapping)
+            ->build();
+    }
+
+    {
+        // compute with data 
+        A_mapping->copy_from(A.ptr(), A.bytes());
+        B_mapping->copy_from(B.ptr(), B.bytes());
+        D_mapping->copy_from(D.ptr(), D.bytes());
+        if (!instance.execute()) {
+            std::cerr << "Execute shader program failed\n";
+            return false;
+        }
+        C_mapping->copy_to(C.ptr(), C.bytes());
+        E_mapping->copy_to(E.ptr(), E.bytes());
+    }
+    // The instance will be automatically destroy here.
+    return true;
+}
+
+int main()
+{
     Mat A{2, 2};
     Mat B{2, 2};
     Mat C{2, 2};
@@ -21,63 +80,28 @@ int main()
 
     cov::Vulkan::init("Matmul");
 
-    {
-        // create instance
-        auto instance{cov::Vulkan::new_instance()};
-        // create data mapping
-        auto A_mapping{instance.add_mem_mapping(A.bytes())};
-        auto B_mapping{instance.add_mem_mapping(B.bytes())};
-        auto C_mapping{instance.add_mem_mapping(C.bytes())};
-        auto D_mapping{instance.add_mem_mapping(D.bytes())};
-        auto E_mapping{instance.add_mem_mapping(E.bytes())};
-
-        {
-            // buid compute pipeline
-            instance.add_transfer_step()
-                ->to_device(A_mapping)
-                ->to_device(B_mapping)
-                ->to_device(D_mapping)
-                ->build();
-
-            instance.add_compute_step()
-                ->load_shader(shader_path)
-                ->set_inputs({A_mapping, B_mapping})
-                ->set_outputs({C_mapping})
-                ->set_workgroup_dims(C.row, C.col, 1)
-                ->build();
-
-            instance.add_compute_step()
-                ->load_shader(shader_path)
-                ->set_inputs({C_mapping, D_mapping})
-                ->set_outputs({E_mapping})
-                ->set_workgroup_dims(E.row, E.col, 1)
-                ->build();
-
-            instance.add_transfer_step()
-                ->from_device(C_mapping)
-                ->from_device(E_mapping)
-                ->build();
-        }
+    if (!run_multi_step(1, A, B, C, D, E)) {
+        return 1;
+    }
+    std::cout << "A: \n" << A << "\n";
+    std::cout << "B: \n" << B << "\n";
+    std::cout << "C = A * B: \n" << C << "\n";
+    std::cout << "D: \n" << D << "\n";
+    std::cout << "E = (A * B) * D: \n" << E << "\n";
 
-        {
-            // compute with data 
-            A_mapping->copy_from(A.ptr(), A.bytes());
-            B_mapping->copy_from(B.ptr(), B.bytes());
-            D_mapping->copy_from(D.ptr(), D.bytes());
-            if (!instance.execute()) {
-                std::cerr << "Execute shader program failed\n";
-            }
-            C_mapping->copy_to(C.ptr(), C.bytes());
-            E_mapping->copy_to(E.ptr(), E.bytes());
-
-            std::cout << "A: \n" << A << "\n";
-            std::cout << "B: \n" << B << "\n";
-            std::cout << "C = A * B: \n" << C << "\n";
-            std::cout << "D: \n" << D << "\n";
-            std::cout << "E = (A * B) * D: \n" << E << "\n";
+    // recording on several threads gives the same results
+    bool passed{true};
+    for (uint32_t record_threads = 2; record_threads <= 4; ++record_threads) {
+        Mat threaded_C{2, 2};
+        Mat threaded_E{2, 2};
+        if (!run_multi_step(record_threads, A, B, threaded_C, D, threaded_E)) {
+            return 1;
         }
-        // The instance will be automatically destroy here.
+        const bool same{std::memcmp(threaded_C.ptr(), C.ptr(), C.bytes()) == 0 &&
+            std::memcmp(threaded_E.ptr(), E.ptr(), E.bytes()) == 0};
+        std::cout << "Recorded on " << record_threads << " threads:" << (same ? " same results\n" : " DIFFERENT results\n");
+        passed = passed && same;
     }
 
-    return 0;
+    return passed ? 0 : 1;
 }
@@ -0,0 +1,111 @@
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#define COV_VULKAN_VALIDATION
+#define COV_IMPLEMENTATION
+#include "cov.hpp"
+
+#ifndef GEMM_SHADER_PATH
+#   define GEMM_SHADER_PATH "examples/shader/gemm.comp.spv"   // suppose we run this program on build dir
+#endif // GEMM_SHADER_PATH
+
+
+// C = alpha * A * B + beta * C on the host, accumulated in double
+void reference_gemm(const cov::GemmOptions& opts, const std::vector<float>& A, const std::vector<float>& B,
+    std::vector<float>& C)
+{
+    for (uint32_t i = 0; i < opts.m; ++i) {
+        for (uint32_t j = 0; j < opts.n; ++j) {
+            double sum{0.0};
+            for (uint32_t k = 0; k < opts.k; ++k) {
+                sum += static_cast<double>(A.at(i * opts.k + k)) * B.at(k * opts.n + j);
+            }
+            C.at(i * opts.n + j) = static_cast<float>(opts.alpha * sum + opts.beta * C.at(i * opts.n + j));
+        }
+    }
+}
+
+bool run_gemm(const cov::GemmOptions& opts)
+{
+    std::mt19937 rng{42};
+    std::uniform_real_distribution<float> dist{-1.0f, 1.0f};
+    std::vector<float> A(opts.m * opts.k);
+    std::vector<float> B(opts.k * opts.n);
+    std::vector<float> C(opts.m * opts.n);
+    for (auto& v : A) v = dist(rng);
+    for (auto& v : B) v = dist(rng);
+    for (auto& v : C) v = dist(rng);
+    std::vector<float> expected{C};
+    reference_gemm(opts, A, B, expected);
+
+    auto instance{cov::Vulkan::new_instance()};
+    auto A_mapping{instance.add_mem_mapping(A.size() * sizeof(float))};
+    auto B_mapping{instance.add_mem_mapping(B.size() * sizeof(float))};
+    auto C_mapping{instance.add_mem_mapping(C.size() * sizeof(float))};
+
+    instance.add_transfer_step()
+        ->to_device(A_mapping)
+        ->to_device(B_mapping)
+        ->to_device(C_mapping)
+        ->build();
+    if (cov::gemm(instance, A_mapping, B_mapping, C_mapping, opts) == nullptr) {
+        std::cerr << "Build gemm step failed\n";
+        return false;
+    }
+    instance.add_transfer_step()
+        ->from_device(C_mapping)
+        ->build();
+
+    A_mapping->copy_from(A.data(), A.size() * sizeof(float));
+    B_mapping->copy_from(B.data(), B.size() * sizeof(float));
+    C_mapping->copy_from(C.data(), C.size() * sizeof(float));
+    if (!instance.execute()) {
+        std::cerr << "Execute shader program failed\n";
+        return false;
+    }
+    C_mapping->copy_to(C.data(), C.size() * sizeof(float));
+
+    // fp32 accumulation error grows with k
+    double max_error{0.0};
+    for (size_t i = 0; i < C.size(); ++i) {
+        max_error = std::max(max_error, static_cast<double>(std::abs(C.at(i) - expected.at(i))));
+    }
+    const bool passed{max_error <= 1e-5 * opts.k};
+    std::cout << opts.m << "x" << opts.n << "x" << opts.k
+        << " alpha " << opts.alpha << " beta " << opts.beta
+        << " max error " << max_error << (passed ? " ok\n" : " FAILED\n");
+    return passed;
+}
+
+
+int main()
+{
+    cov::Vulkan::init("Gemm");
+
+    const std::vector<cov::GemmOptions> problems{
+        {.m = 64, .n = 64, .k = 64, .shader_path = GEMM_SHADER_PATH},
+        // edges of partial tiles and scalar loads
+        {.m = 100, .n = 75, .k = 33, .shader_path = GEMM_SHADER_PATH},
+        {.m = 256, .n = 192, .k = 128, .alpha = 0.5f, .beta = 2.0f, .shader_path = GEMM_SHADER_PATH},
+        // smaller tiles
+        {.m = 96, .n = 80, .k = 200, .shader_path = GEMM_SHADER_PATH, .wg_x = 8, .wg_y = 8, .tm = 2, .tn = 2, .bk = 8},
+    };
+
+    bool passed{true};
+    for (const auto& opts : problems) {
+        passed = run_gemm(opts) && passed;
+    }
+
+    {
+        // time the tile candidates for this shape once, later runs read them from gemm.tuning
+        auto instance{cov::Vulkan::new_instance()};
+        cov::Tuner tuner{instance, "gemm.tuning"};
+        const auto opts{cov::tune_gemm(tuner, {.m = 128, .n = 128, .k = 128, .shader_path = GEMM_SHADER_PATH})};
+        std::cout << "tuned local size " << opts.wg_x << "x" << opts.wg_y
+            << " block " << opts.tm << "x" << opts.tn << " depth " << opts.bk << "\n";
+        passed = run_gemm(opts) && passed;
+    }
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,85 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#define COV_VULKAN_VALIDATION
+#define COV_IMPLEMENTATION
+#include "cov.hpp"
+
+#ifndef SCALE_SHADER_PATH
+#   define SCALE_SHADER_PATH "examples/shader/scale.comp.spv"   // suppose we run this program on build dir
+#endif // SCALE_SHADER_PATH
+
+
+struct ScaleParams
+{
+    uint32_t count;
+    float alpha;
+    float beta;
+}; // struct ScaleParams
+
+
+int main()
+{
+    // 9 full chunks of 1024 floats and a 784 float tail
+    const uint32_t chunk_count{1024};
+    const uint32_t local_size{64};
+    std::vector<float> x(10000);
+    std::vector<float> y(x.size(), 0.0f);
+    for (size_t i = 0; i < x.size(); ++i) {
+        x.at(i) = static_cast<float>(i % 97) - 48.0f;
+    }
+    ScaleParams params{chunk_count, 0.5f, 2.0f};
+
+    cov::Vulkan::init("Stream");
+
+    bool passed{false};
+    {
+        auto instance{cov::Vulkan::new_instance()};
+        // the host fills a chunk while the previous one executes
+        instance.set_frames_in_flight(2);
+        auto x_mapping{instance.add_mem_mapping(chunk_count * sizeof(float))};
+        auto y_mapping{instance.add_mem_mapping(chunk_count * sizeof(float))};
+
+        auto scale{instance.add_compute_step()
+            ->load_shader(SCALE_SHADER_PATH)
+            ->set_descriptor_layout(cov::ComputeStep::DL_SINGLE_SET)
+            ->set_inputs({x_mapping})
+            ->set_outputs({y_mapping}, true)
+            ->set_push_constants(params)
+            ->set_workgroup_dims(chunk_count / local_size, 1, 1)};
+        if (!scale->build()) {
+            std::cerr << "Build scale step failed\n";
+            return 1;
+        }
+
+        // stream() adds the upload of x and the download of y, the tail chunk
+        // passes its valid count so the shader skips the stale elements
+        const bool streamed{instance.stream(
+            {
+                {x_mapping, x.data(), nullptr, x.size() * sizeof(float)},
+                {y_mapping, nullptr, y.data(), y.size() * sizeof(float)},
+            },
+            [&](uint64_t chunk) {
+                params.count = std::min<uint32_t>(chunk_count, static_cast<uint32_t>(x.size() - chunk * chunk_count));
+                scale->set_push_constants(params);
+            })};
+        if (!streamed) {
+            std::cerr << "Stream failed\n";
+            return 1;
+        }
+
+        size_t mismatches{0};
+        for (size_t i = 0; i < x.size(); ++i) {
+            if (std::abs(y.at(i) - (params.alpha * x.at(i) + params.beta)) > 1e-6f) {
+                ++mismatches;
+            }
+        }
+        passed = mismatches == 0;
+        std::cout << x.size() << " floats in chunks of " << chunk_count
+            << ", " << mismatches << " mismatches" << (passed ? " ok\n" : " FAILED\n");
+    }
+
+    return passed ? 0 : 1;
+}
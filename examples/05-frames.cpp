@@ -0,0 +1,104 @@
+#include <deque>
+
+#include "mat.hpp"
+
+#define COV_VULKAN_VALIDATION
+#define COV_IMPLEMENTATION
+#include "cov.hpp"
+
+
+// C = A * B with A = [i, 1; 0, 1] and B = [1, 2; 3, 4]
+bool check_frame(const Mat& C, int i)
+{
+    return C.at(0) == i + 3.0f && C.at(1) == 2.0f * i + 4.0f && C.at(2) == 3.0f && C.at(3) == 4.0f;
+}
+
+int main()
+{
+    const std::string shader_path{"../examples/shader/matmul.comp.spv"};  // suppose we run this program on build dir
+    const uint32_t frames{3};
+    const int frame_total{12};
+
+    Mat A{2, 2};
+    Mat B{2, 2};
+    Mat C{2, 2};
+
+    B << 1.0f, 2.0f, 3.0f, 4.0f;
+
+    cov::Vulkan::init("Frames");
+
+    int failed{0};
+    {
+        // create instance, every mapping gets one set of buffers per frame
+        auto instance{cov::Vulkan::new_instance()};
+        instance.set_frames_in_flight(frames);
+        auto A_mapping{instance.add_mem_mapping(A.bytes())};
+        auto B_mapping{instance.add_mem_mapping(B.bytes())};
+        auto C_mapping{instance.add_mem_mapping(C.bytes())};
+
+        {
+            // buid compute pipeline
+            instance.add_transfer_step()
+                ->to_device(A_mapping)
+                ->to_device(B_mapping)
+                ->build();
+
+            instance.add_compute_step()
+                ->load_shader(shader_path)
+                ->set_inputs({A_mapping, B_mapping})
+                ->set_outputs({C_mapping})
+                ->set_workgroup_dims(C.row, C.col, 1)
+                ->build();
+
+            instance.add_transfer_step()
+                ->from_device(C_mapping)
+                ->build();
+        }
+
+        // submissions in flight with the value of i they were filled with
+        std::deque<std::pair<cov::Submission, int>> pending;
+        auto retire = [&]() {
+            auto [submission, i] = pending.front();
+            pending.pop_front();
+            // ready() polls, the host could keep working until it turns true
+            if (!submission.ready() && !submission.wait_for(UINT64_MAX)) {
+                std::cerr << "Wait for submission " << i << " failed\n";
+                ++failed;
+                return;
+            }
+            C_mapping->copy_to(C.ptr(), C.bytes(), submission.frame());
+            if (!check_frame(C, i)) {
+                std::cerr << "Frame " << submission.frame() << " of submission " << i << " is wrong: \n" << C << "\n";
+                ++failed;
+            }
+        };
+
+        for (int i = 0; i < frame_total; ++i) {
+            // the oldest submission runs on the frame filled next, read its
+            // results before they are overwritten
+            if (pending.size() == frames) {
+                retire();
+            }
+            const uint32_t frame{instance.begin_frame()};
+            A << static_cast<float>(i), 1.0f, 0.0f, 1.0f;
+            A_mapping->copy_from(A.ptr(), A.bytes(), frame);
+            B_mapping->copy_from(B.ptr(), B.bytes(), frame);
+
+            auto submission{instance.submit()};
+            if (!submission.valid()) {
+                std::cerr << "Submit frame " << frame << " failed\n";
+                return 1;
+            }
+            pending.emplace_back(submission, i);
+        }
+        while (!pending.empty()) {
+            retire();
+        }
+
+        std::cout << frame_total << " submissions over " << frames << " frames in flight, "
+            << failed << " wrong" << (failed == 0 ? " ok\n" : " FAILED\n");
+        // The instance will be automatically destroy here.
+    }
+
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,109 @@
+#include <array>
+#include <cmath>
+
+#include "mat.hpp"
+
+#define COV_VULKAN_VALIDATION
+#define COV_IMPLEMENTATION
+#include "cov.hpp"
+
+
+// one set of buffers the compiled graph can be bound to
+struct MatmulSet
+{
+    cov::MemMapping* A;
+    cov::MemMapping* B;
+    cov::MemMapping* C;
+}; // struct MatmulSet
+
+// C = A * B on the host for 2x2 matrices
+bool check_matmul(const Mat& A, const Mat& B, const Mat& C)
+{
+    for (int r = 0; r < 2; ++r) {
+        for (int c = 0; c < 2; ++c) {
+            const float expected{A.at(r * 2) * B.at(c) + A.at(r * 2 + 1) * B.at(2 + c)};
+            if (std::abs(C.at(r * 2 + c) - expected) > 1e-5f) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    const std::string shader_path{"../examples/shader/matmul.comp.spv"};  // suppose we run this program on build dir
+
+    std::array<Mat, 2> A{Mat{2, 2}, Mat{2, 2}};
+    std::array<Mat, 2> B{Mat{2, 2}, Mat{2, 2}};
+    std::array<Mat, 2> C{Mat{2, 2}, Mat{2, 2}};
+
+    A.at(0) << 1.1f, 2.2f, 3.3f, 4.4f;
+    B.at(0) << 5.5f, 6.6f, 7.7f, 8.8f;
+    A.at(1) << 1.0f, -1.0f, 2.0f, 0.5f;
+    B.at(1) << 3.0f, 0.0f, -2.0f, 4.0f;
+
+    cov::Vulkan::init("Arguments");
+
+    bool passed{true};
+    {
+        // create instance
+        auto instance{cov::Vulkan::new_instance()};
+        // the graph is built on named slots instead of mappings
+        auto A_argument{instance.add_argument("A", A.at(0).bytes())};
+        auto B_argument{instance.add_argument("B", B.at(0).bytes())};
+        auto C_argument{instance.add_argument("C", C.at(0).bytes())};
+
+        {
+            // buid compute pipeline once
+            instance.add_transfer_step()
+                ->to_device(A_argument)
+                ->to_device(B_argument)
+                ->build();
+
+            instance.add_compute_step()
+                ->load_shader(shader_path)
+                ->set_inputs({A_argument, B_argument})
+                ->set_outputs({C_argument})
+                ->set_workgroup_dims(C.at(0).row, C.at(0).col, 1)
+                ->build();
+
+            instance.add_transfer_step()
+                ->from_device(C_argument)
+                ->build();
+        }
+
+        std::array<MatmulSet, 2> sets;
+        for (size_t i = 0; i < sets.size(); ++i) {
+            sets.at(i).A = instance.add_mem_mapping(A.at(i).bytes());
+            sets.at(i).B = instance.add_mem_mapping(B.at(i).bytes());
+            sets.at(i).C = instance.add_mem_mapping(C.at(i).bytes());
+        }
+
+        for (size_t i = 0; i < sets.size(); ++i) {
+            // binding only rewrites descriptors, the pipelines are not rebuilt
+            auto& set{sets.at(i)};
+            instance.bind("A", set.A);
+            instance.bind("B", set.B);
+            instance.bind("C", set.C);
+
+            set.A->copy_from(A.at(i).ptr(), A.at(i).bytes());
+            set.B->copy_from(B.at(i).ptr(), B.at(i).bytes());
+            if (!instance.execute()) {
+                std::cerr << "Execute shader program failed\n";
+                return 1;
+            }
+        }
+
+        // every set keeps its own results
+        for (size_t i = 0; i < sets.size(); ++i) {
+            sets.at(i).C->copy_to(C.at(i).ptr(), C.at(i).bytes());
+            const bool set_passed{check_matmul(A.at(i), B.at(i), C.at(i))};
+            std::cout << "C = A * B with set " << i << ": \n" << C.at(i) << (set_passed ? " ok\n" : " FAILED\n");
+            passed = passed && set_passed;
+        }
+        // The instance will be automatically destroy here.
+    }
+
+    return passed ? 0 : 1;
+}
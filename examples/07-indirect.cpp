@@ -0,0 +1,110 @@
+#include <cmath>
+
+#include "mat.hpp"
+
+#define COV_VULKAN_VALIDATION
+#define COV_IMPLEMENTATION
+#include "cov.hpp"
+
+#ifndef DISPATCH_DIMS_SHADER_PATH
+#   define DISPATCH_DIMS_SHADER_PATH "examples/shader/dispatch_dims.comp.spv"   // suppose we run this program on build dir
+#endif // DISPATCH_DIMS_SHADER_PATH
+
+
+// C = A * B on the host
+bool check_matmul(const Mat& A, const Mat& B, const Mat& C)
+{
+    for (int r = 0; r < C.row; ++r) {
+        for (int c = 0; c < C.col; ++c) {
+            float expected{0.0f};
+            for (int k = 0; k < A.col; ++k) {
+                expected += A.at(r * A.col + k) * B.at(k * B.col + c);
+            }
+            if (std::abs(C.at(r * C.col + c) - expected) > 1e-5f) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    const std::string shader_path{"../examples/shader/matmul.comp.spv"};  // suppose we run this program on build dir
+
+    // the mappings fit the largest matrices, the shapes are only known to the device
+    const size_t max_bytes{Mat{4, 4}.bytes()};
+
+    Mat A{2, 2};
+    Mat B{2, 2};
+    Mat C{2, 2};
+    Mat A2{2, 3};
+    Mat B2{4, 2};
+    Mat C2{4, 3};
+
+    A << 1.1f, 2.2f, 3.3f, 4.4f;
+    B << 5.5f, 6.6f, 7.7f, 8.8f;
+    A2 << 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f;
+    B2 << 1.0f, 0.0f, -1.0f, 2.0f, 0.5f, 1.0f, 0.0f, -2.0f;
+
+    cov::Vulkan::init("Indirect");
+
+    bool passed{true};
+    {
+        // create instance
+        auto instance{cov::Vulkan::new_instance()};
+        // create data mapping
+        auto A_mapping{instance.add_mem_mapping(max_bytes)};
+        auto B_mapping{instance.add_mem_mapping(max_bytes)};
+        auto C_mapping{instance.add_mem_mapping(max_bytes)};
+        auto dims_mapping{instance.add_mem_mapping(sizeof(VkDispatchIndirectCommand))};
+
+        {
+            // buid compute pipeline
+            instance.add_transfer_step()
+                ->to_device(A_mapping)
+                ->to_device(B_mapping)
+                ->build();
+
+            // writes the workgroup counts of the next step
+            instance.add_compute_step()
+                ->load_shader(DISPATCH_DIMS_SHADER_PATH)
+                ->set_inputs({A_mapping, B_mapping})
+                ->set_outputs({dims_mapping}, true)
+                ->set_workgroup_dims(1, 1, 1)
+                ->build();
+
+            instance.add_compute_step()
+                ->load_shader(shader_path)
+                ->set_inputs({A_mapping, B_mapping})
+                ->set_outputs({C_mapping})
+                ->set_indirect_dims(dims_mapping)
+                ->build();
+
+            instance.add_transfer_step()
+                ->from_device(C_mapping)
+                ->build();
+        }
+
+        // the same graph for two shapes, nothing is recorded again
+        auto run = [&](Mat& lhs, Mat& rhs, Mat& out) {
+            A_mapping->copy_from(lhs.ptr(), lhs.bytes());
+            B_mapping->copy_from(rhs.ptr(), rhs.bytes());
+            if (!instance.execute()) {
+                std::cerr << "Execute shader program failed\n";
+                return false;
+            }
+            C_mapping->copy_to(out.ptr(), out.bytes());
+
+            const bool shape_passed{check_matmul(lhs, rhs, out)};
+            std::cout << "C = A * B for a " << lhs.row << "x" << lhs.col << " A and a " << rhs.row << "x" << rhs.col
+                << " B: \n" << out << (shape_passed ? " ok\n" : " FAILED\n");
+            return shape_passed;
+        };
+        passed = run(A, B, C);
+        passed = run(A2, B2, C2) && passed;
+        // The instance will be automatically destroy here.
+    }
+
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,80 @@
+#include <iostream>
+#include <vector>
+
+#define COV_VULKAN_VALIDATION
+#define COV_IMPLEMENTATION
+#include "cov.hpp"
+
+
+int main()
+{
+    const size_t count{256};
+    // two disjoint ranges of floats changed after the first upload
+    const std::vector<cov::BufferRange> changed{{16, 16}, {200, 16}};
+
+    std::vector<float> data(count);
+    for (size_t i = 0; i < count; ++i) {
+        data.at(i) = static_cast<float>(i);
+    }
+
+    cov::Vulkan::init("DirtyRanges");
+
+    bool passed{false};
+    {
+        // create instance
+        auto instance{cov::Vulkan::new_instance()};
+        // create data mapping, only the written ranges are uploaded
+        auto mapping{instance.add_mem_mapping(count * sizeof(float))};
+        mapping->track_dirty_ranges();
+
+        // upload and read the whole device buffer back
+        instance.add_transfer_step()
+            ->to_device(mapping)
+            ->build();
+        instance.add_transfer_step()
+            ->from_device(mapping)
+            ->build();
+
+        // copy_from() marks the whole buffer for the first upload
+        mapping->copy_from(data.data(), count * sizeof(float));
+        if (!instance.execute()) {
+            std::cerr << "Execute first upload failed\n";
+            return 1;
+        }
+
+        auto view{mapping->host_view<float>()};
+        if (!instance.unified_memory()) {
+            // bytes written but not marked never reach the device, the
+            // download below overwrites them with the device bytes
+            for (auto& v : view) {
+                v = -1.0f;
+            }
+        }
+        for (const auto& range : changed) {
+            for (size_t i = range.offset; i < range.offset + range.size; ++i) {
+                data.at(i) = 1000.0f + i;
+                view[i] = data.at(i);
+            }
+            mapping->mark_dirty(range.offset * sizeof(float), range.size * sizeof(float), mapping->current_frame());
+        }
+        if (!instance.execute()) {
+            std::cerr << "Execute range upload failed\n";
+            return 1;
+        }
+
+        std::vector<float> result(count);
+        mapping->copy_to(result.data(), count * sizeof(float));
+        size_t mismatches{0};
+        for (size_t i = 0; i < count; ++i) {
+            if (result.at(i) != data.at(i)) {
+                ++mismatches;
+            }
+        }
+        passed = mismatches == 0;
+        std::cout << "2 ranges of " << count << " floats uploaded, " << mismatches
+            << " mismatches" << (passed ? " ok\n" : " FAILED\n");
+        // The instance will be automatically destroy here.
+    }
+
+    return passed ? 0 : 1;
+}